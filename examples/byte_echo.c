@@ -1,27 +1,89 @@
 #include <ctype.h>
 #include <stdio.h>
-#include <unistd.h>
+#include <string.h>
 #define WDSC_IMPLEMENTATION 1
 #include "../screen.h"
 
-int main() {
-	char c = 0;;
+static const char *key_names[] = {
+	"up", "down", "right", "left", "home", "end", "insert", "delete",
+	"pgup", "pgdn", "backtab", "f1", "f2", "f3", "f4", "f5", "f6", "f7",
+	"f8", "f9", "f10", "f11", "f12", "press", "release", "move",
+};
 
-	printf("This program echoes its input byte-by-byte.\n");
-	printf("Press q to quit.\n\n");
+/* With -e, show what wdsc_poll_event() makes of the input instead */
+static void echo_events() {
+	struct wdsc_event ev;
+	int x, y;
 
-	wdsc_init();
+	wdsc_mouse_on();
+	wdsc_paste_on();
+	wdsc_present();
+
+	for (;;) {
+		wdsc_poll_event(&ev);
+		if (ev.type == WDSC_EV_RESIZE) {
+			wdsc_screensize(&x, &y);
+			printf("resized to %ix%i\r\n", x, y);
+			continue;
+		}
+		if (ev.key == 'q' && !ev.mod)
+			break;
+		if (ev.key >= WDSC_KEY_UP)
+			printf("%s", key_names[ev.key - WDSC_KEY_UP]);
+		else if (ev.key < ' ' || ev.key == 0x7f)
+			printf("%02x", ev.key);
+		else
+			printf("U+%04X", ev.key);
+		if (ev.type == WDSC_EV_MOUSE)
+			printf(" button %i at %i,%i", ev.button, ev.x, ev.y);
+		if (ev.mod & WDSC_MOD_SHIFT)
+			printf(" shift");
+		if (ev.mod & WDSC_MOD_ALT)
+			printf(" alt");
+		if (ev.mod & WDSC_MOD_CTRL)
+			printf(" ctrl");
+		if (ev.mod & WDSC_MOD_META)
+			printf(" meta");
+		if (ev.mod & WDSC_MOD_PASTE)
+			printf(" pasted");
+		printf("\r\n");
+	}
+}
+
+static void echo_bytes() {
+	int c = 0;
+	int x, y;
 
 	for (;;) {
 		c = wdsc_poll();
 		if (c == 'q') {
 			break;
+		} else if (c == WDSC_RESIZE) {
+			wdsc_screensize(&x, &y);
+			printf("resized to %ix%i\r\n", x, y);
 		} else if (iscntrl(c)) {
 			printf("%02x\r\n", (unsigned char) c);
 		} else {
 			printf("%02x ('%c')\r\n", (unsigned char) c, c);
 		}
 	}
+}
+
+int main(int argc, char **argv) {
+	int events = argc > 1 && strcmp(argv[1], "-e") == 0;
+
+	if (events)
+		printf("This program decodes its input into events.\n");
+	else
+		printf("This program echoes its input byte-by-byte.\n");
+	printf("Press q to quit.\n\n");
+
+	wdsc_init();
+
+	if (events)
+		echo_events();
+	else
+		echo_bytes();
 
 	wdsc_end();
 
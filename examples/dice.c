@@ -21,6 +21,32 @@ int parsetest(char* dice) {
 	return 0;
 }
 
+/* Constants are folded when the expression is compiled; 1d1* stops that, so
+ * both should agree */
+int foldtest(char* expr) {
+	char unfolded[64];
+	jdice_prog prog;
+	int folded;
+
+	snprintf(unfolded, sizeof(unfolded), "1d1*%s", expr);
+	printf("Evaluating %s both ways...\n", expr);
+	if (jdice_expr_compile(expr, &prog)) {
+		printf("Couldn't compile %s\n", expr);
+		return 1;
+	}
+	folded = jdice_expr_eval(&prog);
+	if (jdice_expr_compile(unfolded, &prog)) {
+		printf("Couldn't compile %s\n", unfolded);
+		return 1;
+	}
+	if (jdice_expr_eval(&prog) != folded) {
+		printf("Folded and unfolded differ for %s\n", expr);
+		return 1;
+	}
+	printf("Both give %i\n", folded);
+	return 0;
+}
+
 void print_roll(int n, void* closure) {
 	printf("%i, ", n);
 }
@@ -75,5 +101,39 @@ int main() {
 	jdice_parse("-2d20", &roll);
 	res = jdice_roll_func(&roll, print_roll, NULL);
 	printf("result: %i\n", res);
+
+	printf("\nNow with our own generator, seeded with 6969...\n");
+	jdice_rng rng;
+	jdice_seed(&rng, 6969);
+	jdice_parse("3d6", &roll);
+	res = jdice_roll_func_r(&rng, &roll, print_roll, NULL);
+	printf("total: %i\n", res);
+
+	printf("\nAnd a whole expression, 4d6kh3+(2d4-1)*2...\n");
+	jdice_prog prog;
+	if (jdice_expr_compile("4d6kh3+(2d4-1)*2", &prog)) {
+		printf("Couldn't compile it\n");
+		return 1;
+	}
+	printf("result: %i\n", jdice_expr_eval_r(&rng, &prog));
+
+	printf("\nThese should come out the same folded or not.\n");
+	if (foldtest("100000*100000/100000") ||
+	    foldtest("(2147483647+1)/2") ||
+	    foldtest("(0-2147483647-1)/-1") ||
+	    foldtest("7/0+5"))
+		return 1;
+
+	printf("\nWhat does 5d6! do, without rolling it?\n");
+	jdice_stats_out stats;
+	jdice_parse("5d6!", &roll);
+	if (jdice_stats(&roll, &stats)) {
+		printf("Couldn't work it out\n");
+		return 1;
+	}
+	printf("mean: %.2f, variance: %.2f\n", stats.mean, stats.variance);
+	printf("median: %i, 99th percentile: %i\n",
+	       jdice_quantile(&stats, 0.5), jdice_quantile(&stats, 0.99));
+	jdice_stats_free(&stats);
 	return 0;
 }
@@ -0,0 +1,206 @@
+/* Throughput benchmarks for jap_dice.h; run with make bench (pass options
+ * with e.g. make bench BENCHFLAGS=-j, and use make -s to keep the output
+ * clean for saving).
+ *
+ * dice_bench [-j] [-t MS]
+ *   -j     print JSON instead of CSV
+ *   -t MS  run each case for about MS milliseconds (default 20)
+ *
+ * Every case prints one record: what was measured (bench), the roll (type,
+ * n, x, t), the generator (rng: rand for JAP_RAND, xoshiro or philox), the
+ * path (plain, func for the _func callbacks, or batch), how many operations
+ * ran, and ns per operation and operations per second. */
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#define JAP_DICE_IMP 1
+#include "../jap_dice.h"
+
+static const char* type_names[] = {"ndx", "fudge", "max", "min", "succ",
+				   "expl", "xsucc", "reroll"};
+
+static bool json = false;
+static bool first = true;
+static double target = 0.02;
+
+/* Results go here so the compiler can't skip the work */
+static volatile long long sink;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* bench, const jap_diceroll* roll,
+		   const char* rng, const char* path, long long ops,
+		   double secs) {
+	double ns = secs * 1e9 / ops;
+	double rate = ops / secs;
+	const char* type = roll ? type_names[roll->type] : "";
+	int n = roll ? roll->n : 0;
+	int x = roll ? roll->x : 0;
+	int t = roll ? roll->t : 0;
+	if (json) {
+		printf("%s\n  {\"bench\": \"%s\", \"type\": \"%s\", \"n\": %i, "
+		       "\"x\": %i, \"t\": %i, \"rng\": \"%s\", \"path\": \"%s\", "
+		       "\"ops\": %lld, \"ns_per_op\": %.3f, "
+		       "\"ops_per_sec\": %.0f}",
+		       first ? "[" : ",", bench, type, n, x, t, rng, path, ops,
+		       ns, rate);
+	} else {
+		if (first)
+			printf("bench,type,n,x,t,rng,path,ops,ns_per_op,"
+			       "ops_per_sec\n");
+		printf("%s,%s,%i,%i,%i,%s,%s,%lld,%.3f,%.0f\n", bench, type, n,
+		       x, t, rng, path, ops, ns, rate);
+	}
+	first = false;
+	fflush(stdout);
+}
+
+static void count_face(int face, void* closure) {
+	*(long long*)closure += face;
+}
+
+/* Roll roll over and over for about target seconds */
+static void bench_roll(jap_diceroll* roll, const char* rng_name,
+		       bool func) {
+	jdice_rng rng;
+	jdice_rng* r = NULL;
+	if (strcmp(rng_name, "xoshiro") == 0) {
+		jdice_seed(&rng, 6969);
+		r = &rng;
+	} else if (strcmp(rng_name, "philox") == 0) {
+		jdice_seed_at(&rng, 6969, 0);
+		r = &rng;
+	} else {
+		srand(6969);
+	}
+
+	long long ops = 0;
+	long long total = 0;
+	double start = now();
+	double secs;
+	do {
+		for (int i = 0; i < 256; i++) {
+			if (func)
+				total += jdice_roll_func_r(r, roll, count_face,
+							   &total);
+			else
+				total += jdice_roll_r(r, roll);
+		}
+		ops += 256;
+		secs = now() - start;
+	} while (secs < target);
+	sink = total;
+	report("roll", roll, rng_name, func ? "func" : "plain", ops, secs);
+}
+
+static void bench_batch(jap_diceroll* roll) {
+	static int out[4096];
+	jdice_rng rng;
+	jdice_seed(&rng, 6969);
+	long long ops = 0;
+	double start = now();
+	double secs;
+	do {
+		jdice_roll_batch_r(&rng, roll, out, 4096);
+		ops += 4096;
+		secs = now() - start;
+	} while (secs < target);
+	sink = out[0];
+	report("roll", roll, "xoshiro", "batch", ops, secs);
+}
+
+static void bench_sampler(jap_diceroll* roll) {
+	jdice_sampler sampler;
+	if (jdice_compile(roll, &sampler))
+		return;
+	jdice_rng rng;
+	jdice_seed(&rng, 6969);
+	long long ops = 0;
+	long long total = 0;
+	double start = now();
+	double secs;
+	do {
+		for (int i = 0; i < 256; i++)
+			total += jdice_sample_r(&rng, &sampler);
+		ops += 256;
+		secs = now() - start;
+	} while (secs < target);
+	sink = total;
+	jdice_sampler_free(&sampler);
+	report("sample", roll, "xoshiro", "plain", ops, secs);
+}
+
+static void bench_parse(void) {
+	static const char* strs[] = {"3d6", "1d20", "+2d20", "-2d20", "4dF",
+				     "100d6", " 10d10 ", "3D", "10d6>5",
+				     "5d6!", "4d10!>8", "8d6r2"};
+	const int count = sizeof(strs) / sizeof(strs[0]);
+	jap_diceroll roll;
+	long long ops = 0;
+	long long total = 0;
+	double start = now();
+	double secs;
+	do {
+		for (int i = 0; i < 256; i++) {
+			total += jdice_parse(strs[i % count], &roll);
+			total += roll.n;
+		}
+		ops += 256;
+		secs = now() - start;
+	} while (secs < target);
+	sink = total;
+	report("parse", NULL, "", "plain", ops, secs);
+}
+
+int main(int argc, char** argv) {
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-j") == 0) {
+			json = true;
+		} else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			target = atof(argv[++i]) / 1000;
+		} else {
+			fprintf(stderr, "usage: %s [-j] [-t MS]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	static const char* rngs[] = {"rand", "xoshiro", "philox"};
+	static const int pools[] = {1, 3, 10, 100};
+	static const int sides[] = {4, 6, 20, 100};
+
+	for (int type = DNDX; type <= DREROLL; type++) {
+		for (int p = 0; p < 4; p++) {
+			for (int s = 0; s < 4; s++) {
+				jap_diceroll roll = {(jap_dice_type)type,
+						     pools[p], sides[s], 0};
+				if (type == DFUDGE) {
+					if (s > 0)
+						break;
+					roll.x = 3;
+				}
+				if (type == DSUCC || type == DXSUCC)
+					roll.t = sides[s] - 1;
+				if (type == DREROLL)
+					roll.t = 1;
+				for (int r = 0; r < 3; r++) {
+					bench_roll(&roll, rngs[r], false);
+					bench_roll(&roll, rngs[r], true);
+				}
+				bench_batch(&roll);
+				bench_sampler(&roll);
+			}
+		}
+	}
+	bench_parse();
+
+	if (json)
+		printf("%s]\n", first ? "[" : "\n");
+	return 0;
+}
@@ -0,0 +1,26 @@
+#include <stdio.h>
+#define JAP_DICE_IMP 1
+#include "../jap_dice.hpp"
+
+using namespace jdice::literals;
+
+int main() {
+	jdice_rng rng;
+	jdice_seed(&rng, 6969);
+
+	/* Parsed by the compiler; "3d0"_dice wouldn't compile */
+	constexpr auto stat = "3d6"_dice;
+	printf("Rolling 3d6 six times: ");
+	for (int i = 0; i < 6; i++)
+		printf("%i ", stat(&rng));
+	printf("\n");
+
+	printf("Advantage, +2d20: %i\n", "+2d20"_dice(&rng));
+	printf("Fudge, 4dF: %+i\n", "4dF"_dice(&rng));
+	printf("Successes, 10d6>5: %i\n", "10d6>5"_dice(&rng));
+
+	/* The same dice for the C functions */
+	jap_diceroll roll = decltype("5d6!"_dice)::roll_struct();
+	printf("Exploding, 5d6!: %i\n", jdice_roll_r(&rng, &roll));
+	return 0;
+}
@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <stdlib.h>
+#define JAP_DICE_IMP 1
+#include "../jap_dice.h"
+
+/* dice_table FILE ROLL...  compiles the rolls and writes them to FILE
+ * dice_table FILE          loads FILE and rolls everything in it */
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		printf("usage: %s FILE [ROLL...]\n", argv[0]);
+		return 1;
+	}
+
+	if (argc > 2) {
+		int count = argc - 2;
+		jap_diceroll* rolls = malloc(count * sizeof(jap_diceroll));
+		for (int i = 0; i < count; i++) {
+			if (jdice_parse(argv[i + 2], &rolls[i])) {
+				printf("Couldn't parse %s\n", argv[i + 2]);
+				return 1;
+			}
+		}
+		int err = jdice_table_write(argv[1], rolls, count);
+		free(rolls);
+		if (err) {
+			printf("Couldn't write %s (%i)\n", argv[1], err);
+			return 1;
+		}
+		printf("Wrote %i rolls to %s\n", count, argv[1]);
+		return 0;
+	}
+
+	jdice_table table;
+	int err = jdice_table_load(argv[1], &table);
+	if (err) {
+		printf("Couldn't load %s (%i)\n", argv[1], err);
+		return 1;
+	}
+	jdice_rng rng;
+	jdice_seed(&rng, 6969);
+	for (int i = 0; i < table.count; i++) {
+		jap_diceroll* roll = &table.rolls[i];
+		printf("type=%i, n=%i, x=%i, t=%i: rolled %i\n", roll->type,
+		       roll->n, roll->x, roll->t,
+		       jdice_sample_r(&rng, &table.samplers[i]));
+	}
+	jdice_table_free(&table);
+	return 0;
+}
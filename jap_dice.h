@@ -11,7 +11,13 @@
  * You can also define your own random number function for this library to use
  * by defining the symbol JAP_RAND(n). Note that it must accept an int and
  * return an int X in the range 0 <= X < n. Alternatively, don't define it and
- * get a bog standard call to rand().
+ * get a bog standard call to rand(), reduced to the range without a division
+ * and without the bias of rand()%n (Lemire's multiply-shift with rejection).
+ * Sums of 8 or more small dice take many dice from each 64-bit random word
+ * (which costs four JAP_RAND(65536) calls without an rng) instead of a draw
+ * per die. Define JAP_DICE_LEGACY_MOD to get the old rand()%n back, e.g. to
+ * reproduce rolls from old seeds; this also applies to the built-in
+ * generator.
  *
  * This file is licensed under the MIT License; see the file LICENSE for
  * details.
@@ -30,6 +36,18 @@
  *   E.G. +2d20 - we get a 14 and a 7, so return 14.
  * - -NdX - Whitehack. Roll N X-Sided dice, take the worst result.
  *   E.G. -2d20 - we get a 14 and a 7, so return 7.
+ * - NdX>T - Dice pool. Roll N X-Sided dice, return how many came up T or
+ *   more.
+ *   E.G. 5d10>8 - we get 9, 3, 8, 10, 1, so return 3.
+ * - NdX! - Exploding dice. Roll N X-Sided dice; every die that comes up X is
+ *   rolled again and added on, and so on. Return the sum.
+ *   E.G. 2d6! - we get 6, 4, and roll the 6 again and get 2, so return 12.
+ * - NdX!>T - Exploding dice pool. As NdX>T, but every die that comes up X
+ *   adds another die to the pool.
+ *   E.G. 3d10!>8 - we get 10, 8, 2, and the extra die is a 4, so return 2.
+ * - NdXrR - Reroll. Roll N X-Sided dice, roll any that come up R or less
+ *   again (once), and return the sum.
+ *   E.G. 2d6r1 - we get a 1 and a 5, reroll the 1 and get 3, so return 8.
  *
  * The parser prioritises speed over accuracy, so has some limitations:
  *
@@ -38,7 +56,8 @@
  * - The parser only understands positive decimal integers.
  * - It follows the philosophy of wanting to return as soon as possible.
  * - It must be passed a proper null-terminated C-string or bad things will
- *   happen.
+ *   happen. Use jdice_parse_n for strings that aren't null-terminated, or
+ *   jdice_parse_bulk to parse a whole buffer of them without copying.
  *
  * Numbers parsed are limited to JAP_DICE_MAX (default 1000) to
  * prevent overflows.
@@ -46,23 +65,176 @@
  * To cache parser results, use the struct jap_diceroll. This is also
  * more reliable with errors.
  *
+ * If you parse the same few strings over and over, keep a jdice_cache and
+ * parse them with jdice_cache_parse. It remembers the last
+ * JAP_DICE_CACHE_SIZE (default 512) distinct strings of up to
+ * JAP_DICE_CACHE_KEY (default 32) bytes, and their parse results, in an
+ * open-addressed hash table, evicting old entries CLOCK-style; longer strings
+ * are just parsed. It counts its hits and misses. A cache is not thread-safe;
+ * give each thread its own. JAP_DICE_CACHE_SIZE must be a power of two, and
+ * at least 8; JAP_DICE_CACHE_KEY must be at most 255.
+ *
+ * For anything more than one term, use the expression compiler,
+ * jdice_expr_compile, which turns a whole expression into a jdice_prog that
+ * jdice_expr_eval can run again and again without allocating anything. It
+ * understands:
+ *
+ * - Numbers, +, -, * and / (which rounds towards zero; x/0 is 0), unary
+ *   minus and brackets, with the usual precedence.
+ *   E.G. (2d6+1d4+3)*2
+ * - NdX, ND and NdF as above, and d% for d100. N may be left out, so d20
+ *   is 1d20.
+ * - Keep and drop: NdXkhM keeps the best M dice, NdXklM keeps the worst M,
+ *   NdXdhM drops the best M and NdXdlM drops the worst M. NdXkM is NdXkhM.
+ *   E.G. 4d6kh3 - roll 4d6 and add up the best three.
+ *
+ * The Whitehack +NdX and -NdX aren't available in expressions; a leading +
+ * or - is just a sign there. N, X and M are limited to JAP_DICE_MAX as in
+ * the parser, but constants can be anything up to INT_MAX, e.g. 1d6+1500.
+ * Keep and drop need X to be at most JAP_DICE_KEEP_MAX (default 1000).
+ * Programs are limited to JAP_DICE_PROG_MAX words of code and
+ * JAP_DICE_STACK_MAX values on the stack; longer or deeper expressions are
+ * parse errors.
+ *
  * Functions can optionally be passed a function pointer f and a void*
  * pointer to arbitrary data (which will be passed to f when it's called).
+ *
+ * Functions ending in _r take a jdice_rng* as their first argument and are
+ * reentrant; give each thread its own jdice_rng, seeded with jdice_seed, and
+ * they can roll without sharing any state. The built-in generator is
+ * xoshiro256**. The rng is nullable; if rng=null, JAP_RAND is used, which is
+ * exactly what the functions without the _r suffix do.
+ *
+ * There is also a counter-based generator, Philox4x32-10, for rolls that have
+ * to be rolled again later, e.g. to replay or audit a game. Set an rng up
+ * with jdice_seed_at and a key and counter (say, the game's seed and the
+ * number of the event), or call jdice_roll_at; either way, the rolls only
+ * depend on the key and counter, so any of them can be rolled again in O(1)
+ * time, on any core or machine, without rolling the ones before it.
+ *
+ * jdice_simulate rolls the same dice many times and counts how often each
+ * result comes up. It splits the work between threads if you define
+ * JAP_DICE_THREADS (and link with -pthread); each thread has its own
+ * generator, jumped ahead from the seed with jdice_jump, so the counts only
+ * depend on the seed and the number of threads, not on whether threads are
+ * enabled or how they get scheduled.
+ *
+ * Dice pools don't roll every die either. The number of successes is one
+ * binomial draw, the number of explosions one negative binomial draw, and the
+ * number of dice to reroll another binomial draw. Only the sums of the dice
+ * that don't explode or get rerolled need rolling, and those are rolled a
+ * word at a time as above, so only the counts take constant time; the sums
+ * still take time in proportion to the number of dice. With JAP_DICE_LARGE
+ * (see below), sums with more than JAP_DICE_LARGE_DIRECT dice and more than
+ * JAP_DICE_LARGE_EXACT possible results are drawn from its normal
+ * approximation instead, so the whole pool takes a handful of random
+ * numbers (but is no longer exact).
+ *
+ * Best-of and worst-of rolls (+NdX and -NdX) don't roll every die; they
+ * take one random number and invert the distribution of the best die, which
+ * is (k/x)^n. Only the _func versions, which have to show you every die,
+ * roll them one by one. (Except with JAP_DICE_LEGACY_MOD and JAP_RAND.)
+ *
+ * Pools bigger than JAP_DICE_MAX, up to billions of dice, can be rolled in
+ * large-pool mode: define JAP_DICE_LARGE (and link with -lm), set up a
+ * jdice_large with jdice_large_init, and roll it with jdice_large_roll_r,
+ * which returns a 64-bit result. Its cost doesn't grow with the number of
+ * dice. Pools of at most JAP_DICE_LARGE_DIRECT (default 64) dice are just
+ * rolled; sums with at most JAP_DICE_LARGE_EXACT (default 4096) possible
+ * results are sampled exactly with an alias table; bigger sums are drawn
+ * from a normal distribution corrected for kurtosis (a Cornish-Fisher
+ * expansion, which is the Edgeworth series turned inside out), rounded to
+ * the nearest whole number. Sums of dice are symmetric, so the first error
+ * term left is of order 1/n^2 in the CDF. Best-of and worst-of pools are
+ * always exact (to 2^-53).
+ *
+ * To find out what a roll does without rolling it, use jdice_stats, which
+ * works out its mean, variance and CDF, and then jdice_cdf and
+ * jdice_quantile; jdice_pmf gives the chance of each result. Sums are built
+ * up a die at a time with running sums, or with an FFT (taking the die to
+ * the nth power by squaring) for 32 dice or more in large-pool mode.
+ * Exploding dice can go on forever, so their chances are cut off where
+ * jdice_range says, but their means and variances are exact.
+ *
+ * Rolls can also be compiled with jdice_compile, which works out the chance
+ * of every result once and builds an alias table from it; rolling a compiled
+ * jdice_sampler then takes one random number and a table lookup, however
+ * many dice there are. The chances are exact to within 2^-32.
+ *
+ * Compiling lots of rolls at startup takes time, so jdice_table_write can
+ * compile them once and save them to a file, and jdice_table_load can load
+ * them again later. The file is mapped read-only (with mmap, where there is
+ * one; define JAP_DICE_NO_MMAP to read it into memory instead), and samplers
+ * are rolled straight from the mapped pages, so processes loading the same
+ * file share one copy of it. The file has a version number and is in the
+ * writer's byte order; loading refuses a file that doesn't match. Only the
+ * layout is checked, not the tables, so only load files you trust.
+ *
+ * To roll the same dice many times, use jdice_roll_batch_r; it runs several
+ * xoshiro256** streams side by side (with SSE2 or AVX2 where the compiler
+ * allows it; define JAP_DICE_NO_SIMD to always use plain C) and fills an
+ * array with the results. The streams are seeded from rng (or, for
+ * jdice_roll_batch, from JAP_RAND), and give the same results whichever
+ * instruction set is used.
+ *
+ * From C++17, jap_dice.hpp can parse dice at compile time: "3d6"_dice.
  */
 
 #ifndef _JAP_DICE_H
 #define _JAP_DICE_H 1
 
-typedef enum {DNDX, DFUDGE, DMAX, DMIN} jap_dice_type;
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif	/* __cplusplus */
+
+typedef enum {DNDX, DFUDGE, DMAX, DMIN, DSUCC, DEXPL, DXSUCC,
+	      DREROLL} jap_dice_type;
 
 typedef struct {
 	jap_dice_type type;
 	int n;
 	int x;
+	int t;	/* Target for DSUCC and DXSUCC, highest reroll for DREROLL */
 } jap_diceroll;
 
 typedef void (*jdice_func)(int, void*);
 
+/* Kinds of built-in random number generator */
+typedef enum {JDICE_XOSHIRO, JDICE_PHILOX} jdice_rng_kind;
+
+/* State of the built-in random number generator */
+typedef struct {
+	uint64_t s[4];		/* xoshiro256** state, or Philox key, counter
+				 * and spare output */
+	jdice_rng_kind kind;
+	int spare;		/* Philox: whether s[3] hasn't been used yet */
+} jdice_rng;
+
+/* Seed the generator rng; equal seeds give equal sequences of rolls */
+void jdice_seed(jdice_rng* rng, uint64_t seed);
+
+/* Set rng up as the counter-based generator (Philox4x32-10) at the given
+ * counter under key; the random numbers it gives are a pure function of key,
+ * counter and how many have been drawn, so counter can be e.g. the number of
+ * an event to roll it again later without rolling everything before it */
+void jdice_seed_at(jdice_rng* rng, uint64_t key, uint64_t counter);
+
+/* Return the next 64 random bits from rng */
+uint64_t jdice_next(jdice_rng* rng);
+
+/* Advance rng by 2^128 draws (for Philox, move on to the next counter); use
+ * this to make non-overlapping generators for different threads from the
+ * same seed */
+void jdice_jump(jdice_rng* rng);
+
+/* Return a random int X in the range 0 <= X < x. rng is nullable; if
+ * rng=null, JAP_RAND is used. */
+int jdice_uniform(jdice_rng* rng, int x);
+
 /* Roll NdX and return the sum */
 int jdice_ndx(int n, int x);
 
@@ -88,97 +260,878 @@ int jdice_max_func(int n, int x, jdice_func f, void* closure);
 /* Roll NdX and return the worst roll; call a function on each roll */
 int jdice_min_func(int n, int x, jdice_func f, void* closure);
 
+/* Roll NdX and return how many came up t or more */
+int jdice_succ(int n, int x, int t);
+
+/* Roll NdX, exploding on x, and return the sum */
+int jdice_expl(int n, int x);
+
+/* Roll NdX, exploding on x, and return how many came up t or more */
+int jdice_xsucc(int n, int x, int t);
+
+/* Roll NdX, reroll each die that comes up r or less once, and return the
+ * sum */
+int jdice_reroll(int n, int x, int r);
+
+/* As above; call a function on each roll (including explosions and
+ * rerolls) */
+int jdice_succ_func(int n, int x, int t, jdice_func f, void* closure);
+int jdice_expl_func(int n, int x, jdice_func f, void* closure);
+int jdice_xsucc_func(int n, int x, int t, jdice_func f, void* closure);
+int jdice_reroll_func(int n, int x, int r, jdice_func f, void* closure);
+
+/* Reentrant versions of the above; see jdice_rng */
+int jdice_ndx_r(jdice_rng* rng, int n, int x);
+int jdice_fudge_r(jdice_rng* rng, int n);
+int jdice_max_r(jdice_rng* rng, int n, int x);
+int jdice_min_r(jdice_rng* rng, int n, int x);
+int jdice_ndx_func_r(jdice_rng* rng, int n, int x, jdice_func f,
+		     void* closure);
+int jdice_fudge_func_r(jdice_rng* rng, int n, jdice_func f, void* closure);
+int jdice_max_func_r(jdice_rng* rng, int n, int x, jdice_func f,
+		     void* closure);
+int jdice_min_func_r(jdice_rng* rng, int n, int x, jdice_func f,
+		     void* closure);
+int jdice_succ_r(jdice_rng* rng, int n, int x, int t);
+int jdice_expl_r(jdice_rng* rng, int n, int x);
+int jdice_xsucc_r(jdice_rng* rng, int n, int x, int t);
+int jdice_reroll_r(jdice_rng* rng, int n, int x, int r);
+int jdice_succ_func_r(jdice_rng* rng, int n, int x, int t, jdice_func f,
+		      void* closure);
+int jdice_expl_func_r(jdice_rng* rng, int n, int x, jdice_func f,
+		      void* closure);
+int jdice_xsucc_func_r(jdice_rng* rng, int n, int x, int t, jdice_func f,
+		       void* closure);
+int jdice_reroll_func_r(jdice_rng* rng, int n, int x, int r, jdice_func f,
+			void* closure);
+
 /* Parse the string s and put the parse result in roll; return 0 on
  * success, JAP_DICE_PARSERR otherwise. roll is nullable; if roll=null, the
  * function will do a dry run. */
 int jdice_parse(const char* s, jap_diceroll* roll);
 
+/* As jdice_parse, but parse the len bytes at s, which needn't be
+ * null-terminated */
+int jdice_parse_n(const char* s, size_t len, jap_diceroll* roll);
+
+/* Parse the expressions in the len bytes at buf, which are separated by the
+ * byte sep (e.g. '\n'), into rolls, putting what jdice_parse_n returned for
+ * each in errs. Stops after max expressions. Returns the number of
+ * expressions parsed, and sets *consumed (if consumed isn't null) to the
+ * number of bytes used, so that a second call can carry on from there. The
+ * last expression needn't be followed by sep; to parse a stream in chunks,
+ * pass each chunk up to and including its last separator. */
+size_t jdice_parse_bulk(const char* buf, size_t len, char sep,
+			jap_diceroll* rolls, int* errs, size_t max,
+			size_t* consumed);
+
 /* Roll the dice described in roll */
 int jdice_roll(jap_diceroll* roll);
 
 /* Roll the dice described in roll; call a function on each roll */
 int jdice_roll_func(jap_diceroll* roll, jdice_func f, void* closure);
 
+/* Reentrant versions of the above; see jdice_rng */
+int jdice_roll_r(jdice_rng* rng, jap_diceroll* roll);
+int jdice_roll_func_r(jdice_rng* rng, jap_diceroll* roll, jdice_func f,
+		      void* closure);
+
+/* Roll the dice described in roll with a generator set up by jdice_seed_at;
+ * this always gives the same result for the same key and counter, on any
+ * machine */
+int jdice_roll_at(const jap_diceroll* roll, uint64_t key, uint64_t counter);
+
+/* Put the smallest and largest possible results of roll in min and max.
+ * Exploding dice have no largest result; for them, max is the point past
+ * which results have less than a 2^-40 chance. */
+void jdice_range(const jap_diceroll* roll, int* min, int* max);
+
+/* Roll roll trials times, with nthreads generators seeded from seed, and
+ * count the results in hist; hist[i] is the number of times min+i came up,
+ * where min is as given by jdice_range, so it needs room for max-min+1
+ * counts (any results past max are counted as max). Return 0 on success,
+ * JAP_DICE_NOMEM if we ran out of memory. */
+int jdice_simulate(const jap_diceroll* roll, uint64_t seed,
+		   unsigned long long trials, int nthreads, uint64_t* hist);
+
+/* Put the chance of each result of roll in pmf; pmf[i] is the chance of
+ * min+i, where min is as given by jdice_range, so it needs room for
+ * max-min+1 chances (the chance of anything past max is added to max).
+ * Nothing is rolled. Return 0 on success, JAP_DICE_PARSERR if roll is not a
+ * valid roll, or JAP_DICE_NOMEM if we ran out of memory.
+ *
+ * The dice are added one at a time, so a sum of n X-sided dice takes
+ * O(n^2 x) time. Only with JAP_DICE_LARGE do 32 dice or more go through an
+ * FFT instead, in O(nx log nx). Nothing is remembered between calls (that
+ * would take state shared between threads); to use the same distribution
+ * again, keep the jdice_stats_out from jdice_stats, or the jdice_sampler
+ * from jdice_compile, which are built the same way. */
+int jdice_pmf(const jap_diceroll* roll, double* pmf);
+
+/* The exact distribution of a roll; see jdice_stats */
+typedef struct {
+	int min;		/* Smallest result, as given by jdice_range */
+	int max;		/* Largest result, as given by jdice_range */
+	double mean;		/* Mean result */
+	double variance;	/* Variance of the result */
+	double* cdf;		/* cdf[i] is the chance of min+i or less */
+} jdice_stats_out;
+
+/* Work out the distribution of roll and put it in stats. The mean and
+ * variance are exact, even for exploding dice. Return 0 on success,
+ * JAP_DICE_PARSERR if roll is not a valid roll, or JAP_DICE_NOMEM if we ran
+ * out of memory. Free it with jdice_stats_free. */
+int jdice_stats(const jap_diceroll* roll, jdice_stats_out* stats);
+
+/* The chance of rolling k or less */
+double jdice_cdf(const jdice_stats_out* stats, int k);
+
+/* The smallest result that the chance of rolling it or less is at least p,
+ * e.g. p=0.5 for the median */
+int jdice_quantile(const jdice_stats_out* stats, double p);
+
+/* Free the memory used by stats */
+void jdice_stats_free(jdice_stats_out* stats);
+
+/* A roll compiled to an alias table; see jdice_compile */
+typedef struct {
+	int min;		/* Smallest possible result */
+	int size;		/* Number of possible results */
+	uint32_t reject;	/* Rejection threshold for picking a slot */
+	uint32_t* prob;		/* Chance of keeping each slot, out of 2^32 */
+	int32_t* alias;		/* Slot to take instead if we don't keep it */
+	void* mem;		/* Memory backing the tables, or null if borrowed */
+} jdice_sampler;
+
+/* Work out the distribution of roll and put a sampler for it in sampler.
+ * Return 0 on success, JAP_DICE_PARSERR if roll is not a valid roll, or
+ * JAP_DICE_NOMEM if we ran out of memory. Free it with jdice_sampler_free. */
+int jdice_compile(const jap_diceroll* roll, jdice_sampler* sampler);
+
+/* Roll the dice compiled into sampler */
+int jdice_sample(const jdice_sampler* sampler);
+
+/* Reentrant version of the above; see jdice_rng */
+int jdice_sample_r(jdice_rng* rng, const jdice_sampler* sampler);
+
+/* Free the memory used by sampler */
+void jdice_sampler_free(jdice_sampler* sampler);
+
+/* A file of compiled rolls; see jdice_table_load */
+typedef struct {
+	int count;			/* Number of rolls */
+	jap_diceroll* rolls;		/* The rolls */
+	jdice_sampler* samplers;	/* Their samplers, borrowing the file */
+	const void* data;		/* The file's contents */
+	size_t length;			/* Length of the file */
+} jdice_table;
+
+/* Compile the count rolls in rolls and write them to the file at path.
+ * Return 0 on success, JAP_DICE_PARSERR if a roll is not a valid roll,
+ * JAP_DICE_NOMEM if we ran out of memory, or JAP_DICE_IOERR if the file
+ * couldn't be written. */
+int jdice_table_write(const char* path, const jap_diceroll* rolls, int count);
+
+/* Load the rolls written to the file at path by jdice_table_write into
+ * table; roll them with jdice_sample_r(rng, &table->samplers[i]). Return 0 on
+ * success, JAP_DICE_IOERR if the file couldn't be read, JAP_DICE_PARSERR if
+ * it isn't a table file (or is from another version or byte order), or
+ * JAP_DICE_NOMEM if we ran out of memory. Free it with jdice_table_free. */
+int jdice_table_load(const char* path, jdice_table* table);
+
+/* Return the index in table of the sampler for roll, or -1 if there isn't
+ * one */
+int jdice_table_find(const jdice_table* table, const jap_diceroll* roll);
+
+/* Unload table */
+void jdice_table_free(jdice_table* table);
+
+#ifdef JAP_DICE_LARGE
+/* A pool of dice for large-pool mode; see jdice_large_init */
+typedef struct {
+	jap_dice_type type;
+	int64_t n;
+	int x;
+	jdice_sampler exact;	/* Alias table, if exact.mem isn't null */
+	double mean;		/* Otherwise, the normal approximation */
+	double sd;
+	double kurt;		/* Excess kurtosis of the sum */
+} jdice_large;
+
+/* Set up pool to roll n X-sided dice of the given type (x is ignored for
+ * DFUDGE). Return 0 on success, JAP_DICE_PARSERR if n or x is less than 1 or
+ * type is one of the dice pool types (DSUCC and on), or JAP_DICE_NOMEM if we
+ * ran out of memory. Free it with jdice_large_free. */
+int jdice_large_init(jdice_large* pool, jap_dice_type type, int64_t n, int x);
+
+/* Roll the dice in pool */
+int64_t jdice_large_roll(const jdice_large* pool);
+
+/* Reentrant version of the above; see jdice_rng */
+int64_t jdice_large_roll_r(jdice_rng* rng, const jdice_large* pool);
+
+/* Free the memory used by pool */
+void jdice_large_free(jdice_large* pool);
+#endif	/* JAP_DICE_LARGE */
+
+/* Roll the dice described in roll count times, putting each result in out.
+ * The streams are seeded with 64 bits from JAP_RAND, so srand() still decides
+ * the rolls, but after that JAP_RAND isn't called again. */
+void jdice_roll_batch(const jap_diceroll* roll, int* out, size_t count);
+
+/* Roll n X-sided dice, putting each face (1 <= face <= x) in out, seeded as
+ * above. Return 0 on success, or JAP_DICE_PARSERR (and roll nothing) if x is
+ * less than 1 or greater than 255, which wouldn't fit in a uint8_t. */
+int jdice_faces_batch(size_t n, int x, uint8_t* out);
+
+/* Reentrant versions of the above; see jdice_rng. Their streams are seeded
+ * from rng. If rng=null, they fall back to one JAP_RAND call per die, with
+ * no streams at all. */
+void jdice_roll_batch_r(jdice_rng* rng, const jap_diceroll* roll, int* out,
+			size_t count);
+int jdice_faces_batch_r(jdice_rng* rng, size_t n, int x, uint8_t* out);
+
 /* Parse the string s and roll immediately. Return JAP_DICE_PARSERR if
  * parser error. */
 int jdice_parse_and_roll(const char* s);
 
+#ifndef JAP_DICE_CACHE_SIZE
+#define JAP_DICE_CACHE_SIZE 512
+#endif	/* JAP_DICE_CACHE_SIZE */
+
+#ifndef JAP_DICE_CACHE_KEY
+#define JAP_DICE_CACHE_KEY 32
+#endif	/* JAP_DICE_CACHE_KEY */
+
+#if JAP_DICE_CACHE_SIZE < 8 || \
+	(JAP_DICE_CACHE_SIZE & (JAP_DICE_CACHE_SIZE - 1)) != 0
+#error "JAP_DICE_CACHE_SIZE must be a power of two, and at least 8"
+#endif
+#if JAP_DICE_CACHE_KEY > 255
+#error "JAP_DICE_CACHE_KEY must be at most 255"
+#endif
+
+/* Number of slots looked at for each key; must divide JAP_DICE_CACHE_SIZE */
+#define JDICE__CACHE_PROBE 8
+
+/* An entry in a jdice_cache */
+typedef struct {
+	uint32_t hash;
+	bool used;
+	bool ref;		/* Hit since the clock hand last passed */
+	uint8_t len;
+	char key[JAP_DICE_CACHE_KEY];
+	int res;
+	jap_diceroll roll;
+} jdice_cache_entry;
+
+/* A cache of parser results; see jdice_cache_parse */
+typedef struct {
+	jdice_cache_entry slot[JAP_DICE_CACHE_SIZE];
+	/* Where each window's clock hand points */
+	uint8_t hand[JAP_DICE_CACHE_SIZE / JDICE__CACHE_PROBE];
+	unsigned long hits;
+	unsigned long misses;
+} jdice_cache;
+
+/* Empty cache, and reset its counters */
+void jdice_cache_init(jdice_cache* cache);
+
+/* Like jdice_parse, but look in cache first, and remember the result */
+int jdice_cache_parse(jdice_cache* cache, const char* s, jap_diceroll* roll);
+
+/* Like jdice_parse_and_roll, but look in cache first */
+int jdice_cache_parse_and_roll(jdice_cache* cache, const char* s);
+
+#ifndef JAP_DICE_PROG_MAX
+#define JAP_DICE_PROG_MAX 64
+#endif	/* JAP_DICE_PROG_MAX */
+
+#ifndef JAP_DICE_STACK_MAX
+#define JAP_DICE_STACK_MAX 16
+#endif	/* JAP_DICE_STACK_MAX */
+
+/* A compiled dice expression; see jdice_expr_compile */
+typedef struct {
+	int len;
+	int32_t code[JAP_DICE_PROG_MAX];
+} jdice_prog;
+
+/* Compile the expression s and put the program in prog; return 0 on
+ * success, JAP_DICE_PARSERR otherwise. prog is nullable; if prog=null, the
+ * function will do a dry run. */
+int jdice_expr_compile(const char* s, jdice_prog* prog);
+
+/* Run the program prog and return the result */
+int jdice_expr_eval(const jdice_prog* prog);
+
+/* Reentrant version of the above; see jdice_rng */
+int jdice_expr_eval_r(jdice_rng* rng, const jdice_prog* prog);
+
 #define JAP_DICE_PARSERR -6969
+#define JAP_DICE_NOMEM -6970
+#define JAP_DICE_IOERR -6971
+
+#ifdef __cplusplus
+}
+#endif	/* __cplusplus */
 
 #ifdef JAP_DICE_IMP
 
 #include <limits.h>
-#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(JAP_DICE_NO_MMAP) && (defined(__unix__) || \
+	(defined(__APPLE__) && defined(__MACH__)))
+#define JDICE__MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif	/* JAP_DICE_NO_MMAP */
+
+#ifdef JAP_DICE_THREADS
+#include <pthread.h>
+#endif	/* JAP_DICE_THREADS */
+
+#ifdef JAP_DICE_LARGE
+#include <math.h>
+
+#ifndef JAP_DICE_LARGE_DIRECT
+#define JAP_DICE_LARGE_DIRECT 64
+#endif	/* JAP_DICE_LARGE_DIRECT */
+
+#ifndef JAP_DICE_LARGE_EXACT
+#define JAP_DICE_LARGE_EXACT 4096
+#endif	/* JAP_DICE_LARGE_EXACT */
+#endif	/* JAP_DICE_LARGE */
+
+#ifndef JAP_DICE_NO_SIMD
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#endif	/* JAP_DICE_NO_SIMD */
 
 #ifndef JAP_DICE_MAX
 #define JAP_DICE_MAX 1000
 #endif	/* JAP_DICE_MAX */
 
+#ifndef JAP_DICE_KEEP_MAX
+#define JAP_DICE_KEEP_MAX 1000
+#endif	/* JAP_DICE_KEEP_MAX */
+
 #ifndef JAP_RAND
-#include <stdlib.h>
+#if defined(JAP_DICE_LEGACY_MOD)
+#define JAP_RAND(x) (rand()%x)
+#elif RAND_MAX == 0x7FFFFFFF || RAND_MAX == 0x7FFF
+#define JDICE__RAND_BITS (RAND_MAX == 0x7FFF ? 15 : 31)
+#define JAP_RAND(x) jdice__rand_bounded(x)
+#else
+/* rand() doesn't give us a whole number of bits; fall back to modulo */
 #define JAP_RAND(x) (rand()%x)
+#endif
 #endif	/* JAP_RAND */
 
-int jdice_ndx(int n, int x) {
+static inline uint64_t jdice__rotl(uint64_t x, int k) {
+	return (x << k) | (x >> (64 - k));
+}
+
+void jdice_seed(jdice_rng* rng, uint64_t seed) {
+	/* Fill the state with splitmix64, as recommended by xoshiro's authors */
+	for (int i = 0; i < 4; i++) {
+		uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		rng->s[i] = z ^ (z >> 31);
+	}
+	rng->kind = JDICE_XOSHIRO;
+	rng->spare = 0;
+}
+
+void jdice_seed_at(jdice_rng* rng, uint64_t key, uint64_t counter) {
+	/* The counter is 128 bits; the top half is ours to pick, the bottom
+	 * half counts blocks of output */
+	rng->s[0] = key;
+	rng->s[1] = 0;
+	rng->s[2] = counter;
+	rng->s[3] = 0;
+	rng->kind = JDICE_PHILOX;
+	rng->spare = 0;
+}
+
+// Internal helper function: Philox4x32-10 (Salmon et al., "Parallel Random
+// Numbers: As Easy as 1, 2, 3"). Ten rounds of multiplies and xors turn the
+// 128-bit counter in ctr into 128 random bits, with the 64-bit key bumped by
+// Weyl constants between rounds.
+static void jdice__philox(uint32_t ctr[4], uint64_t key) {
+	uint32_t k0 = (uint32_t)key;
+	uint32_t k1 = (uint32_t)(key >> 32);
+	for (int i = 0; i < 10; i++) {
+		uint64_t p0 = (uint64_t)0xD2511F53 * ctr[0];
+		uint64_t p1 = (uint64_t)0xCD9E8D57 * ctr[2];
+		ctr[0] = (uint32_t)(p1 >> 32) ^ ctr[1] ^ k0;
+		ctr[1] = (uint32_t)p1;
+		ctr[2] = (uint32_t)(p0 >> 32) ^ ctr[3] ^ k1;
+		ctr[3] = (uint32_t)p0;
+		k0 += 0x9E3779B9;
+		k1 += 0xBB67AE85;
+	}
+}
+
+// Internal helper function: jdice_next for Philox. Each block gives two
+// words; the second is kept in s[3] for next time. Kept out of line so that
+// jdice_next stays small enough to inline for xoshiro.
+#ifdef __GNUC__
+__attribute__((noinline))
+#endif
+static uint64_t jdice__philox_next(jdice_rng* rng) {
+	uint64_t* s = rng->s;
+	if (rng->spare) {
+		rng->spare = 0;
+		return s[3];
+	}
+	uint32_t ctr[4] = {(uint32_t)s[1], (uint32_t)(s[1] >> 32),
+			   (uint32_t)s[2], (uint32_t)(s[2] >> 32)};
+	jdice__philox(ctr, s[0]);
+	if (++s[1] == 0)
+		s[2]++;
+	s[3] = ctr[2] | ((uint64_t)ctr[3] << 32);
+	rng->spare = 1;
+	return ctr[0] | ((uint64_t)ctr[1] << 32);
+}
+
+// Internal helper function: jdice_next, for the rest of the library to inline.
+static inline uint64_t jdice__next(jdice_rng* rng) {
+	if (rng->kind == JDICE_PHILOX)
+		return jdice__philox_next(rng);
+	uint64_t* s = rng->s;
+	uint64_t result = jdice__rotl(s[1] * 5, 7) * 9;
+	uint64_t t = s[1] << 17;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = jdice__rotl(s[3], 45);
+	return result;
+}
+
+uint64_t jdice_next(jdice_rng* rng) {
+	return jdice__next(rng);
+}
+
+#ifdef JDICE__RAND_BITS
+// Internal helper function: n random bits, from as many rand() calls as it
+// takes; any bits left over come off the bottom.
+static inline uint64_t jdice__rand_word(int n) {
+	uint64_t r = 0;
+	int have = 0;
+	for (; have < n; have += JDICE__RAND_BITS)
+		r = (r << JDICE__RAND_BITS) | (uint64_t)rand();
+	return r >> (have - n);
+}
+
+// Internal helper function: the default JAP_RAND. Reduces rand() to
+// 0 <= X < x using Lemire's multiply-shift, rejecting the few values that
+// would bias the result. Dice bigger than rand()'s range use two calls, or
+// three (for 32 bits) if two 15-bit calls aren't enough either.
+static inline int jdice__rand_bounded(int x) {
+	int bits = JDICE__RAND_BITS;
+	uint64_t s = (uint64_t)x;
+
+	if (s <= (uint64_t)1 << bits) {
+		if ((s & (s - 1)) == 0)
+			return rand() & (int)(s - 1);
+	} else {
+		bits = s <= (uint64_t)1 << 2 * bits ? 2 * bits : 32;
+	}
+	uint64_t range = (uint64_t)1 << bits;
+
+	uint64_t m = jdice__rand_word(bits) * s;
+	uint64_t l = m & (range - 1);
+	if (l < s) {
+		uint64_t t = (range - s) % s;
+		while (l < t) {
+			m = jdice__rand_word(bits) * s;
+			l = m & (range - 1);
+		}
+	}
+	return (int)(m >> bits);
+}
+#endif	/* JDICE__RAND_BITS */
+
+void jdice_jump(jdice_rng* rng) {
+	if (rng->kind == JDICE_PHILOX) {
+		jdice_seed_at(rng, rng->s[0], rng->s[2] + 1);
+		return;
+	}
+	static const uint64_t jump[] = {0x180EC6D33CFD0ABAULL,
+		0xD5A61266F0C9392CULL, 0xA9582618E03FC9AAULL,
+		0x39ABDC4529B1661CULL};
+	uint64_t s[4] = {0, 0, 0, 0};
+	for (int i = 0; i < 4; i++) {
+		for (int b = 0; b < 64; b++) {
+			if (jump[i] & ((uint64_t)1 << b)) {
+				for (int j = 0; j < 4; j++)
+					s[j] ^= rng->s[j];
+			}
+			jdice__next(rng);
+		}
+	}
+	for (int j = 0; j < 4; j++)
+		rng->s[j] = s[j];
+}
+
+// Internal helper function: draw 0 <= X < x from rng, or JAP_RAND if rng is
+// null. All of the kernels go through here.
+static inline int jdice__rand(jdice_rng* rng, int x) {
+	if (rng == NULL)
+		return JAP_RAND(x);
+#ifdef JAP_DICE_LEGACY_MOD
+	return (int)(jdice__next(rng) % (uint64_t)x);
+#else
+	uint32_t s = (uint32_t)x;
+	uint64_t r = jdice__next(rng);
+
+	/* d2, d4, d8, ... just take the low bits */
+	if ((s & (s - 1)) == 0)
+		return (int)(r & (s - 1));
+
+	uint64_t m = (r >> 32) * s;
+	uint32_t l = (uint32_t)m;
+	if (l < s) {
+		uint32_t t = -s % s;
+		while (l < t) {
+			m = (jdice__next(rng) >> 32) * s;
+			l = (uint32_t)m;
+		}
+	}
+	return (int)(m >> 32);
+#endif	/* JAP_DICE_LEGACY_MOD */
+}
+
+int jdice_uniform(jdice_rng* rng, int x) {
+	return jdice__rand(rng, x);
+}
+
+// Internal helper function: 32 random bits from rng, or JAP_RAND if rng is
+// null.
+static inline uint32_t jdice__bits32(jdice_rng* rng) {
+	if (rng == NULL)
+		return ((uint32_t)JAP_RAND(1 << 16) << 16) |
+			(uint32_t)JAP_RAND(1 << 16);
+	return (uint32_t)(jdice__next(rng) >> 32);
+}
+
+// Internal helper function: b to the power of e, by squaring.
+static double jdice__powi(double b, long long e) {
+	double result = 1;
+	while (e > 0) {
+		if (e & 1)
+			result *= b;
+		b *= b;
+		e >>= 1;
+	}
+	return result;
+}
+
+// Internal helper function: a*b as a 128-bit number; returns the top half
+// and puts the bottom half in *lo.
+static inline uint64_t jdice__mul128(uint64_t a, uint64_t b, uint64_t* lo) {
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 m = (unsigned __int128)a * b;
+	*lo = (uint64_t)m;
+	return (uint64_t)(m >> 64);
+#else
+	uint64_t al = a & 0xFFFFFFFF, ah = a >> 32;
+	uint64_t bl = b & 0xFFFFFFFF, bh = b >> 32;
+	uint64_t ll = al * bl, lh = al * bh, hl = ah * bl, hh = ah * bh;
+	uint64_t mid = (ll >> 32) + (lh & 0xFFFFFFFF) + (hl & 0xFFFFFFFF);
+	*lo = (mid << 32) | (ll & 0xFFFFFFFF);
+	return hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+}
+
+// Internal helper function: draw 0 <= X < s from rng, 64-bit version of
+// jdice__rand. rng must not be null.
+static inline uint64_t jdice__rand64(jdice_rng* rng, uint64_t s) {
+	uint64_t lo;
+	uint64_t hi = jdice__mul128(jdice__next(rng), s, &lo);
+	if (lo < s) {
+		uint64_t t = -s % s;
+		while (lo < t)
+			hi = jdice__mul128(jdice__next(rng), s, &lo);
+	}
+	return hi;
+}
+
+// Internal helper function: a random double 0 <= X < 1 with 53 bits of
+// precision, from rng, or JAP_RAND if rng is null.
+static inline double jdice__unit(jdice_rng* rng) {
+	if (rng == NULL)
+		return ((double)JAP_RAND(1 << 26) * 134217728.0 +
+			JAP_RAND(1 << 27)) / 9007199254740992.0;
+	return (jdice__next(rng) >> 11) / 9007199254740992.0;
+}
+
+// Internal helper function: the best of n X-sided dice, from one draw. The
+// chance of it being k or less is (k/x)^n, so draw U uniformly below x^n and
+// find the smallest k with k^n > U. If x^n is too big for that, do the same
+// with a double in [0, 1) (exact to 2^-53).
+static int jdice__max_closed(jdice_rng* rng, long long n, int x) {
+	/* x^n would never grow, and the loop below would run n times */
+	if (x == 1)
+		return 1;
+	uint64_t xn = 1;
+	long long e = 0;
+	while (e < n && xn <= UINT64_MAX / (uint64_t)x) {
+		xn *= (uint64_t)x;
+		e++;
+	}
+
+	int lo = 1;
+	int hi = x;
+	if (e == n && (rng != NULL || xn <= (1 << 30))) {
+		uint64_t u = rng != NULL ? jdice__rand64(rng, xn) :
+			(uint64_t)JAP_RAND((int)xn);
+		while (lo < hi) {
+			int mid = lo + (hi - lo) / 2;
+			uint64_t p = 1;
+			for (long long i = 0; i < n; i++)
+				p *= (uint64_t)mid;
+			if (p > u)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+	} else {
+		double u = jdice__unit(rng);
+		while (lo < hi) {
+			int mid = lo + (hi - lo) / 2;
+			if (jdice__powi((double)mid / x, n) > u)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+	}
+	return lo;
+}
+
+// Internal helper function: 64 random bits from rng, or four JAP_RAND calls
+// if rng is null.
+static inline uint64_t jdice__word(jdice_rng* rng) {
+	if (rng == NULL)
+		return ((uint64_t)jdice__bits32(NULL) << 32) | jdice__bits32(NULL);
+	return jdice__next(rng);
+}
+
+// Internal helper function: the number of set bits in w.
+static inline int jdice__popcount(uint64_t w) {
+#if defined(__GNUC__) && defined(__POPCNT__)
+	return __builtin_popcountll(w);
+#else
+	w -= (w >> 1) & 0x5555555555555555;
+	w = (w & 0x3333333333333333) + ((w >> 2) & 0x3333333333333333);
+	w = (w + (w >> 4)) & 0x0F0F0F0F0F0F0F0F;
+	return (int)((w * 0x0101010101010101) >> 56);
+#endif
+}
+
+// Internal helper function: whether to roll n X-sided dice a word at a time
+// rather than one draw each. A few dice are quicker one at a time, and
+// without an rng each word costs four JAP_RAND calls, so only do it for lots
+// of small dice then.
+static inline bool jdice__by_words(jdice_rng* rng, long long n, int x) {
+#ifdef JAP_DICE_LEGACY_MOD
+	(void)rng;
+	(void)n;
+	(void)x;
+	return false;
+#else
+	return n >= 8 && (rng != NULL || x <= 256);
+#endif	/* JAP_DICE_LEGACY_MOD */
+}
+
+// Internal helper function: the sum of n X-sided dice counting from 0, taking
+// as many dice from each random word as it holds.
+//
+// If x is 2^b, a word is 64/b fields of b bits, added up a bit plane at a
+// time with popcount. Otherwise the word is read as a fraction and multiplied
+// by x once per die, the whole part being the face; that is Lemire's method
+// for a draw below x^k (k dice), with the base-x digits of the draw coming
+// out one at a time, so the few words that would bias it are rejected the
+// same way. k is picked so that happens to less than 1 word in 256.
+static long long jdice__sum_words(jdice_rng* rng, long long n, int x) {
+	uint64_t s = (uint64_t)x;
+	long long sum = 0;
+
+	if ((s & (s - 1)) == 0) {
+		int b = 0;
+		while (((uint64_t)1 << b) < s)
+			b++;
+		if (b == 0)
+			return 0;
+		long long per = 64 / b;
+		/* Bit 0 of each field */
+		uint64_t plane = UINT64_MAX / (s - 1);
+		if (per * b < 64)
+			plane &= ((uint64_t)1 << (per * b)) - 1;
+		while (n > 0) {
+			uint64_t w = jdice__word(rng);
+			uint64_t m = plane;
+			if (n < per) {
+				m &= ((uint64_t)1 << (n * b)) - 1;
+				n = 0;
+			} else {
+				n -= per;
+			}
+			for (int j = 0; j < b; j++)
+				sum += (long long)jdice__popcount(w & (m << j)) << j;
+		}
+		return sum;
+	}
+
+	int k = 0;
+	uint64_t xk = 1;
+	uint64_t limit = ((uint64_t)1 << 56) / s;
+	while (k < n && xk <= limit) {
+		xk *= s;
+		k++;
+	}
+
+	while (n > 0) {
+		int take = k;
+		if (n < k) {
+			take = (int)n;
+			xk = 1;
+			for (int i = 0; i < take; i++)
+				xk *= s;
+		}
+		for (;;) {
+			uint64_t r = jdice__word(rng);
+			long long part = 0;
+			for (int i = 0; i < take; i++)
+				part += (long long)jdice__mul128(r, s, &r);
+			/* r is now the low half of word * x^take */
+			if (r >= xk || r >= -xk % xk) {
+				sum += part;
+				break;
+			}
+		}
+		n -= take;
+	}
+	return sum;
+}
+
+// Internal helper function: the sum of n fudge dice, a word at a time. Each
+// pair of bits is a die: 00 is -, 01 is blank, 10 is +, and 11 is thrown
+// away, so a word is good for 24 dice on average, counted with popcount.
+static int jdice__fudge_words(jdice_rng* rng, int n) {
+	const uint64_t lanes = 0x5555555555555555;
+	int sum = 0;
+	while (n > 0) {
+		uint64_t w = jdice__word(rng);
+		uint64_t lo = w & lanes;
+		uint64_t hi = (w >> 1) & lanes;
+		uint64_t ok = ~(lo & hi) & lanes;
+		int got = jdice__popcount(ok);
+		if (got > n) {
+			/* Keep the lowest n dice */
+			uint64_t rest = ok;
+			for (int i = 0; i < n; i++)
+				rest &= rest - 1;
+			ok ^= rest;
+			got = n;
+		}
+		sum += jdice__popcount(hi & ok) - jdice__popcount(~(lo | hi) & ok);
+		n -= got;
+	}
+	return sum;
+}
+
+int jdice_ndx_r(jdice_rng* rng, int n, int x) {
+	if (jdice__by_words(rng, n, x))
+		return n + (int)jdice__sum_words(rng, n, x);
 	int result = 0;
 	for (int i = 0; i < n; i++) {
-		result += JAP_RAND(x)+1;
+		result += jdice__rand(rng, x)+1;
 	}
 	return result;
 }
 
-int jdice_fudge(int n) {
+int jdice_fudge_r(jdice_rng* rng, int n) {
+	if (jdice__by_words(rng, n, 3))
+		return jdice__fudge_words(rng, n);
 	int result = 0;
 	for (int i = 0; i < n; i++) {
-		result += JAP_RAND(3)-1;
+		result += jdice__rand(rng, 3)-1;
 	}
 	return result;
 }
 
-int jdice_max(int n, int x) {
+int jdice_max_r(jdice_rng* rng, int n, int x) {
+#ifdef JAP_DICE_LEGACY_MOD
+	if (rng != NULL && n > 1)
+#else
+	if (n > 1)
+#endif	/* JAP_DICE_LEGACY_MOD */
+		return jdice__max_closed(rng, n, x);
 	int result = 0;
 	for (int i = 0; i < n; i++) {
-		int roll = JAP_RAND(x)+1;
+		int roll = jdice__rand(rng, x)+1;
 		if (roll > result)
 			result = roll;
 	}
 	return result;
 }
 
-int jdice_min(int n, int x) {
+int jdice_min_r(jdice_rng* rng, int n, int x) {
+	/* The worst of n dice is the best of n upside-down dice */
+#ifdef JAP_DICE_LEGACY_MOD
+	if (rng != NULL && n > 1)
+#else
+	if (n > 1)
+#endif	/* JAP_DICE_LEGACY_MOD */
+		return x + 1 - jdice__max_closed(rng, n, x);
 	int result = INT_MAX;
 	for (int i = 0; i < n; i++) {
-		int roll = JAP_RAND(x)+1;
+		int roll = jdice__rand(rng, x)+1;
 		if (roll < result)
 			result = roll;
 	}
 	return result;
 }
 
-int jdice_ndx_func(int n, int x, jdice_func f, void* closure) {
+int jdice_ndx_func_r(jdice_rng* rng, int n, int x, jdice_func f,
+		     void* closure) {
 	int result = 0;
 	for (int i = 0; i < n; i++) {
-		int roll = JAP_RAND(x)+1;
+		int roll = jdice__rand(rng, x)+1;
 		f(roll, closure);
 		result += roll;
 	}
 	return result;
 }
 
-int jdice_fudge_func(int n, jdice_func f, void* closure) {
+int jdice_fudge_func_r(jdice_rng* rng, int n, jdice_func f, void* closure) {
 	int result = 0;
 	for (int i = 0; i < n; i++) {
-		int roll = JAP_RAND(3)-1;
+		int roll = jdice__rand(rng, 3)-1;
 		f(roll, closure);
 		result += roll;
 	}
 	return result;
 }
 
-int jdice_max_func(int n, int x, jdice_func f, void* closure) {
+int jdice_max_func_r(jdice_rng* rng, int n, int x, jdice_func f,
+		     void* closure) {
 	int result = 0;
 	for (int i = 0; i < n; i++) {
-		int roll = JAP_RAND(x)+1;
+		int roll = jdice__rand(rng, x)+1;
 		f(roll, closure);
 		if (roll > result)
 			result = roll;
@@ -186,10 +1139,11 @@ int jdice_max_func(int n, int x, jdice_func f, void* closure) {
 	return result;
 }
 
-int jdice_min_func(int n, int x, jdice_func f, void* closure) {
+int jdice_min_func_r(jdice_rng* rng, int n, int x, jdice_func f,
+		     void* closure) {
 	int result = INT_MAX;
 	for (int i = 0; i < n; i++) {
-		int roll = JAP_RAND(x)+1;
+		int roll = jdice__rand(rng, x)+1;
 		f(roll, closure);
 		if (roll < result)
 			result = roll;
@@ -197,77 +1151,409 @@ int jdice_min_func(int n, int x, jdice_func f, void* closure) {
 	return result;
 }
 
-// Internal helper function: asserts that the string contains only whitespace.
-// Returns 0 on success, or else JAP_DICE_PARSERR.
-static int jdice__whitespace_or_error(const char* s) {
-	char c;
-	while ((c = *s++) != 0) {
-		switch (c) {
-			case ' ':
-			case '\t':
-			case '\n':
-			case '\r':
-				break;
-			default:
-				return JAP_DICE_PARSERR;
+// Internal helper function: the number of successes in n trials with chance
+// p each. Inverts the CDF, working up from 0 successes, 1000 trials at a
+// time so that the chance of none can't underflow.
+static int jdice__binomial(jdice_rng* rng, int n, double p) {
+	if (p <= 0)
+		return 0;
+	if (p >= 1)
+		return n;
+	if (p > 0.5)
+		return n - jdice__binomial(rng, n, 1 - p);
+
+	double ratio = p / (1 - p);
+	int result = 0;
+	while (n > 0) {
+		int chunk = n < 1000 ? n : 1000;
+		n -= chunk;
+		double u = jdice__unit(rng);
+		double pk = jdice__powi(1 - p, chunk);
+		int k = 0;
+		while (u >= pk && k < chunk) {
+			u -= pk;
+			pk *= ratio * (chunk - k) / (k + 1);
+			k++;
 		}
+		result += k;
 	}
+	return result;
+}
 
-	return 0;
+// Internal helper function: the total number of explosions of n exploding
+// X-sided dice, i.e. the number of times a chance 1/x comes up before n
+// chances (x-1)/x do. Inverts the CDF like jdice__binomial.
+static int jdice__explosions(jdice_rng* rng, int n, int x) {
+	double r = 1.0 / x;
+	int result = 0;
+	while (n > 0) {
+		int chunk = n < 1000 ? n : 1000;
+		n -= chunk;
+		double u = jdice__unit(rng);
+		double pk = jdice__powi(1 - r, chunk);
+		int k = 0;
+		while (u >= pk && pk > 0) {
+			u -= pk;
+			pk *= r * (chunk + k) / (k + 1);
+			k++;
+		}
+		result += k;
+	}
+	return result;
 }
 
-int jdice_parse(const char* s, jap_diceroll* roll) {
-	int num = 0;
-	bool seenn = false;
-	bool firstchr = true;
-	jap_dice_type type = DNDX;
-	for (const char* str = s; *str!=0; str++) {
-		char ch = *str;
-		bool whitespace = false;
-		switch (ch) {
-		case '+':
-			if (!firstchr) return JAP_DICE_PARSERR;
-			type = DMAX;
-			break;
-		case '-':
-			if (!firstchr) return JAP_DICE_PARSERR;
-			type = DMIN;
-			break;
-		case 'D':
-			if (roll!=NULL) {
-				roll->type = type;
-				roll->x = 6;
-			}
-			/* fallthrough */
-		case 'd':
-			if(num == 0 || num > JAP_DICE_MAX || seenn) return JAP_DICE_PARSERR;
+// Internal helper function: the sum of n X-sided dice. With JAP_DICE_LARGE,
+// if there are too many dice and results to roll or sample exactly, it comes
+// from large-pool mode's normal approximation instead.
+static int jdice__pool_sum(jdice_rng* rng, int n, int x) {
+#ifdef JAP_DICE_LARGE
+	if (n > JAP_DICE_LARGE_DIRECT &&
+	    (int64_t)n * (x - 1) + 1 > JAP_DICE_LARGE_EXACT) {
+		/* No alias table, so this doesn't allocate */
+		jdice_large pool;
+		jdice_large_init(&pool, DNDX, n, x);
+		return (int)jdice_large_roll_r(rng, &pool);
+	}
+#endif	/* JAP_DICE_LARGE */
+	return jdice_ndx_r(rng, n, x);
+}
 
-			if (roll!=NULL) roll->n = num;
-			seenn = true;
-			num = 0;
-			break;
-		case 'f':
-		case 'F':
-			if (!seenn || type != DNDX) return JAP_DICE_PARSERR;
-			if (roll != NULL) {
-				roll->type=DFUDGE;
-			}
-			return jdice__whitespace_or_error(str + 1);
-		case ' ':
-		case '\t':
-		case '\n':
-		case '\r':
-			/* Ignore whitespace */
-			whitespace = true;
+int jdice_succ_r(jdice_rng* rng, int n, int x, int t) {
+	return jdice__binomial(rng, n, (double)(x - t + 1) / x);
+}
+
+int jdice_expl_r(jdice_rng* rng, int n, int x) {
+	if (x < 2)
+		return n * x;
+	/* Every explosion is worth x; the last die of each chain is 1..x-1 */
+	return x * jdice__explosions(rng, n, x) + jdice__pool_sum(rng, n, x - 1);
+}
+
+int jdice_xsucc_r(jdice_rng* rng, int n, int x, int t) {
+	if (x < 2)
+		return jdice_succ_r(rng, n, x, t);
+	/* Every explosion is a success; the last die of each chain is 1..x-1 */
+	return jdice__explosions(rng, n, x) +
+		jdice__binomial(rng, n, (double)(x - t) / (x - 1));
+}
+
+int jdice_reroll_r(jdice_rng* rng, int n, int x, int r) {
+	if (r >= x)
+		return jdice_ndx_r(rng, n, x);
+	/* Dice that stay put are r+1..x; rerolled ones are anything */
+	int k = jdice__binomial(rng, n, (double)r / x);
+	return (n - k) * r + jdice__pool_sum(rng, n - k, x - r) +
+		jdice__pool_sum(rng, k, x);
+}
+
+int jdice_succ_func_r(jdice_rng* rng, int n, int x, int t, jdice_func f,
+		      void* closure) {
+	int result = 0;
+	for (int i = 0; i < n; i++) {
+		int roll = jdice__rand(rng, x)+1;
+		f(roll, closure);
+		if (roll >= t)
+			result++;
+	}
+	return result;
+}
+
+int jdice_expl_func_r(jdice_rng* rng, int n, int x, jdice_func f,
+		      void* closure) {
+	int result = 0;
+	for (int i = 0; i < n; i++) {
+		int roll;
+		do {
+			roll = jdice__rand(rng, x)+1;
+			f(roll, closure);
+			result += roll;
+		} while (roll == x && x > 1);
+	}
+	return result;
+}
+
+int jdice_xsucc_func_r(jdice_rng* rng, int n, int x, int t, jdice_func f,
+		       void* closure) {
+	int result = 0;
+	for (int i = 0; i < n; i++) {
+		int roll;
+		do {
+			roll = jdice__rand(rng, x)+1;
+			f(roll, closure);
+			if (roll >= t)
+				result++;
+		} while (roll == x && x > 1);
+	}
+	return result;
+}
+
+int jdice_reroll_func_r(jdice_rng* rng, int n, int x, int r, jdice_func f,
+			void* closure) {
+	int result = 0;
+	for (int i = 0; i < n; i++) {
+		int roll = jdice__rand(rng, x)+1;
+		f(roll, closure);
+		if (roll <= r) {
+			roll = jdice__rand(rng, x)+1;
+			f(roll, closure);
+		}
+		result += roll;
+	}
+	return result;
+}
+
+int jdice_ndx(int n, int x) {
+	return jdice_ndx_r(NULL, n, x);
+}
+
+int jdice_fudge(int n) {
+	return jdice_fudge_r(NULL, n);
+}
+
+int jdice_max(int n, int x) {
+	return jdice_max_r(NULL, n, x);
+}
+
+int jdice_min(int n, int x) {
+	return jdice_min_r(NULL, n, x);
+}
+
+int jdice_ndx_func(int n, int x, jdice_func f, void* closure) {
+	return jdice_ndx_func_r(NULL, n, x, f, closure);
+}
+
+int jdice_fudge_func(int n, jdice_func f, void* closure) {
+	return jdice_fudge_func_r(NULL, n, f, closure);
+}
+
+int jdice_max_func(int n, int x, jdice_func f, void* closure) {
+	return jdice_max_func_r(NULL, n, x, f, closure);
+}
+
+int jdice_min_func(int n, int x, jdice_func f, void* closure) {
+	return jdice_min_func_r(NULL, n, x, f, closure);
+}
+
+int jdice_succ(int n, int x, int t) {
+	return jdice_succ_r(NULL, n, x, t);
+}
+
+int jdice_expl(int n, int x) {
+	return jdice_expl_r(NULL, n, x);
+}
+
+int jdice_xsucc(int n, int x, int t) {
+	return jdice_xsucc_r(NULL, n, x, t);
+}
+
+int jdice_reroll(int n, int x, int r) {
+	return jdice_reroll_r(NULL, n, x, r);
+}
+
+int jdice_succ_func(int n, int x, int t, jdice_func f, void* closure) {
+	return jdice_succ_func_r(NULL, n, x, t, f, closure);
+}
+
+int jdice_expl_func(int n, int x, jdice_func f, void* closure) {
+	return jdice_expl_func_r(NULL, n, x, f, closure);
+}
+
+int jdice_xsucc_func(int n, int x, int t, jdice_func f, void* closure) {
+	return jdice_xsucc_func_r(NULL, n, x, t, f, closure);
+}
+
+int jdice_reroll_func(int n, int x, int r, jdice_func f, void* closure) {
+	return jdice_reroll_func_r(NULL, n, x, r, f, closure);
+}
+
+// Internal helper function: asserts that the string contains only whitespace.
+// Returns 0 on success, or else JAP_DICE_PARSERR.
+static int jdice__whitespace_or_error(const char* s, const char* end) {
+	while (s != end) {
+		switch (*s++) {
+			case ' ':
+			case '\t':
+			case '\n':
+			case '\r':
+				break;
+			default:
+				return JAP_DICE_PARSERR;
+		}
+	}
+
+	return 0;
+}
+
+// Internal helper function: reads the run of digits at s (stopping at end)
+// onto the end of *num, eight at a time where it can. Numbers bigger than
+// JAP_DICE_MAX stick at JAP_DICE_MAX+1. Returns the end of the run.
+static const char* jdice__digits(const char* s, const char* end, int* num) {
+	uint64_t n = (uint64_t)*num;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+	__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	static const uint32_t pow10[] = {1, 10, 100, 1000, 10000, 100000,
+					 1000000, 10000000, 100000000};
+	while (end - s >= 8) {
+		uint64_t w;
+		memcpy(&w, s, 8);
+
+		/* A byte is a digit if it's 0x3_, and still is after adding 6.
+		 * Adding 6 can carry into the next byte, but only out of a
+		 * byte that's already not a digit, so the first non-digit is
+		 * always right. Then fold each byte's flags into its top bit. */
+		uint64_t bad = ((w & 0xF0F0F0F0F0F0F0F0) ^ 0x3030303030303030) |
+			(((w + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) ^
+			 0x3030303030303030);
+		bad = (((bad & 0x7070707070707070) + 0x7070707070707070) | bad) &
+			0x8080808080808080;
+		int k = bad ? __builtin_ctzll(bad) / 8 : 8;
+		if (k == 0)
+			break;
+
+		/* Line the k digits up at the top, pad with leading '0's, and
+		 * convert all eight at once. */
+		if (k < 8)
+			w = (w << (8 * (8 - k))) | (0x3030303030303030 >> (8 * k));
+		w -= 0x3030303030303030;
+		w = (w * 10) + (w >> 8);
+		w = (((w & 0x000000FF000000FF) * (100 + (1000000ULL << 32))) +
+		     (((w >> 16) & 0x000000FF000000FF) *
+		      (1 + (10000ULL << 32)))) >> 32;
+
+		n = n * pow10[k] + (uint32_t)w;
+		if (n > JAP_DICE_MAX)
+			n = JAP_DICE_MAX + 1;
+		s += k;
+		if (k < 8) {
+			*num = (int)n;
+			return s;
+		}
+	}
+#endif
+	while (s != end && '0' <= *s && *s <= '9') {
+		n = (10 * n) + (uint64_t)(*s++ - '0');
+		if (n > JAP_DICE_MAX)
+			n = JAP_DICE_MAX + 1;
+	}
+	*num = (int)n;
+	return s;
+}
+
+// Internal helper function: skip whitespace, then read a number that must be
+// there. Return null if it isn't.
+static const char* jdice__pool_number(const char* s, const char* end,
+				      int* num) {
+	while (s != end && (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r'))
+		s++;
+	if (s == end || *s < '0' || *s > '9')
+		return NULL;
+	return jdice__digits(s, end, num);
+}
+
+// Internal helper function: parse the dice pool suffix of an NdX roll that
+// starts at s ('!', '>' or 'r'), and fill in roll.
+static int jdice__parse_pool(const char* s, const char* end, int n, int x,
+			     jap_diceroll* roll) {
+	jap_dice_type type;
+	int t = 0;
+	if (*s == '!') {
+		type = DEXPL;
+		if (x < 2) return JAP_DICE_PARSERR;
+		s++;
+		const char* p = s;
+		while (p != end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+			p++;
+		if (p != end && *p == '>') {
+			type = DXSUCC;
+			s = p;
+		}
+	} else {
+		type = *s == '>' ? DSUCC : DREROLL;
+	}
+	if (type != DEXPL) {
+		s = jdice__pool_number(s + 1, end, &t);
+		if (s == NULL) return JAP_DICE_PARSERR;
+		if (type == DREROLL ? t >= x : t > x) return JAP_DICE_PARSERR;
+		if (t < 1) return JAP_DICE_PARSERR;
+	}
+	int err = jdice__whitespace_or_error(s, end);
+	if (err) return err;
+	if (roll != NULL) {
+		roll->type = type;
+		roll->n = n;
+		roll->x = x;
+		roll->t = t;
+	}
+	return 0;
+}
+
+int jdice_parse(const char* s, jap_diceroll* roll) {
+	return jdice_parse_n(s, strlen(s), roll);
+}
+
+int jdice_parse_n(const char* s, size_t len, jap_diceroll* roll) {
+	const char* end = s + len;
+	int num = 0;
+	int dice = 0;
+	bool seenn = false;
+	bool firstchr = true;
+	jap_dice_type type = DNDX;
+	for (const char* str = s; str != end; str++) {
+		char ch = *str;
+		bool whitespace = false;
+		switch (ch) {
+		case '+':
+			if (!firstchr) return JAP_DICE_PARSERR;
+			type = DMAX;
+			break;
+		case '-':
+			if (!firstchr) return JAP_DICE_PARSERR;
+			type = DMIN;
+			break;
+		case 'D':
+			if (roll!=NULL) {
+				roll->type = type;
+				roll->x = 6;
+				roll->t = 0;
+			}
+			/* fallthrough */
+		case 'd':
+			if(num == 0 || num > JAP_DICE_MAX || seenn) return JAP_DICE_PARSERR;
+
+			if (roll!=NULL) roll->n = num;
+			dice = num;
+			seenn = true;
+			num = 0;
+			break;
+		case 'f':
+		case 'F':
+			if (!seenn || type != DNDX) return JAP_DICE_PARSERR;
+			if (roll != NULL) {
+				roll->type=DFUDGE;
+				roll->t = 0;
+			}
+			return jdice__whitespace_or_error(str + 1, end);
+		case '!':
+		case '>':
+		case 'r':
+			if (!seenn || type != DNDX || num == 0 || num > JAP_DICE_MAX)
+				return JAP_DICE_PARSERR;
+			return jdice__parse_pool(str, end, dice, num, roll);
+		case ' ':
+		case '\t':
+		case '\n':
+		case '\r':
+			/* Ignore whitespace */
+			whitespace = true;
 			break;
 		default:
 			if ('0' <= ch && ch <= '9') {
-				num = (10 * num) + (ch - '0');
+				str = jdice__digits(str, end, &num) - 1;
 			} else {
 				return JAP_DICE_PARSERR;
 			}
 		}
-		if (ch=='D') return jdice__whitespace_or_error(str + 1);
+		if (ch=='D') return jdice__whitespace_or_error(str + 1, end);
 		if (!whitespace) firstchr = false;
 	}
 	if(num == 0 || num > JAP_DICE_MAX || !seenn) return JAP_DICE_PARSERR;
@@ -275,35 +1561,1252 @@ int jdice_parse(const char* s, jap_diceroll* roll) {
 	if (roll!=NULL) {
 		roll->x = num;
 		roll->type = type;
+		roll->t = 0;
 	}
 
 	return 0;
 }
 
-int jdice_roll(jap_diceroll* roll) {
+size_t jdice_parse_bulk(const char* buf, size_t len, char sep,
+			jap_diceroll* rolls, int* errs, size_t max,
+			size_t* consumed) {
+	const char* s = buf;
+	const char* end = buf + len;
+	size_t count = 0;
+	while (s != end && count < max) {
+		const char* next = (const char*)memchr(s, sep, end - s);
+		const char* stop = next != NULL ? next : end;
+		errs[count] = jdice_parse_n(s, stop - s, &rolls[count]);
+		count++;
+		s = next != NULL ? next + 1 : end;
+	}
+	if (consumed != NULL)
+		*consumed = s - buf;
+	return count;
+}
+
+int jdice_roll_r(jdice_rng* rng, jap_diceroll* roll) {
 	switch (roll->type) {
 	case DNDX:
-		return jdice_ndx(roll->n, roll->x);
+		return jdice_ndx_r(rng, roll->n, roll->x);
 	case DFUDGE:
-		return jdice_fudge(roll->n);
+		return jdice_fudge_r(rng, roll->n);
 	case DMAX:
-		return jdice_max(roll->n, roll->x);
+		return jdice_max_r(rng, roll->n, roll->x);
+	case DSUCC:
+		return jdice_succ_r(rng, roll->n, roll->x, roll->t);
+	case DEXPL:
+		return jdice_expl_r(rng, roll->n, roll->x);
+	case DXSUCC:
+		return jdice_xsucc_r(rng, roll->n, roll->x, roll->t);
+	case DREROLL:
+		return jdice_reroll_r(rng, roll->n, roll->x, roll->t);
 	default:
-		return jdice_min(roll->n, roll->x);
+		return jdice_min_r(rng, roll->n, roll->x);
 	}
 }
 
+int jdice_roll_func_r(jdice_rng* rng, jap_diceroll* roll, jdice_func f,
+		      void* closure) {
+	switch (roll->type) {
+	case DNDX:
+		return jdice_ndx_func_r(rng, roll->n, roll->x, f, closure);
+	case DFUDGE:
+		return jdice_fudge_func_r(rng, roll->n, f, closure);
+	case DMAX:
+		return jdice_max_func_r(rng, roll->n, roll->x, f, closure);
+	case DSUCC:
+		return jdice_succ_func_r(rng, roll->n, roll->x, roll->t, f,
+					 closure);
+	case DEXPL:
+		return jdice_expl_func_r(rng, roll->n, roll->x, f, closure);
+	case DXSUCC:
+		return jdice_xsucc_func_r(rng, roll->n, roll->x, roll->t, f,
+					  closure);
+	case DREROLL:
+		return jdice_reroll_func_r(rng, roll->n, roll->x, roll->t, f,
+					   closure);
+	default:
+		return jdice_min_func_r(rng, roll->n, roll->x, f, closure);
+	}
+}
+
+int jdice_roll(jap_diceroll* roll) {
+	return jdice_roll_r(NULL, roll);
+}
+
 int jdice_roll_func(jap_diceroll* roll, jdice_func f, void* closure) {
+	return jdice_roll_func_r(NULL, roll, f, closure);
+}
+
+int jdice_roll_at(const jap_diceroll* roll, uint64_t key, uint64_t counter) {
+	jdice_rng rng;
+	jdice_seed_at(&rng, key, counter);
+	return jdice_roll_r(&rng, (jap_diceroll*)roll);
+}
+
+// Internal helper function: a number of explosions of n exploding X-sided
+// dice that has less than a 2^-40 chance of being beaten.
+static int jdice__explosions_max(int n, int x) {
+	double r = 1.0 / x;
+	double pk = jdice__powi(1 - r, n);
+	if (pk > 0) {
+		/* Add up the distribution until the tail is small enough */
+		double cum = 0;
+		int k = 0;
+		while (1 - cum >= 1.0 / (1LL << 40) && pk > 0) {
+			cum += pk;
+			pk *= r * (n + k) / (k + 1);
+			k++;
+		}
+		return k;
+	}
+	/* Too many dice for that; no die explodes more than g times */
+	int g = 0;
+	double tail = n;
+	while (tail >= 1.0 / (1LL << 40)) {
+		tail *= r;
+		g++;
+	}
+	return n * g;
+}
+
+void jdice_range(const jap_diceroll* roll, int* min, int* max) {
+	int n = roll->n;
+	int x = roll->x;
+	switch (roll->type) {
+	case DNDX:
+	case DREROLL:
+		*min = n;
+		*max = n * x;
+		break;
+	case DFUDGE:
+		*min = -n;
+		*max = n;
+		break;
+	case DSUCC:
+		*min = 0;
+		*max = n;
+		break;
+	case DEXPL:
+		*min = n;
+		*max = x < 2 ? n * x : n * (x - 1) + x * jdice__explosions_max(n, x);
+		break;
+	case DXSUCC:
+		*min = 0;
+		*max = x < 2 ? n : n + jdice__explosions_max(n, x);
+		break;
+	default:
+		*min = 1;
+		*max = x;
+	}
+}
+
+// Internal type: one thread's share of jdice_simulate.
+typedef struct {
+	jap_diceroll roll;
+	jdice_rng rng;
+	unsigned long long trials;
+	int min;
+	int last;
+	uint64_t* hist;
+} jdice__sim_job;
+
+static void* jdice__sim_worker(void* arg) {
+	/* The jobs sit side by side in one array, so work on copies; only
+	 * the histogram, which has its own cache lines, is written to */
+	const jdice__sim_job* job = (const jdice__sim_job*)arg;
+	jap_diceroll roll = job->roll;
+	jdice_rng rng = job->rng;
+	unsigned long long trials = job->trials;
+	int min = job->min;
+	int last = job->last;
+	uint64_t* hist = job->hist;
+	for (unsigned long long i = 0; i < trials; i++) {
+		int k = jdice_roll_r(&rng, &roll) - min;
+		hist[k < last ? k : last]++;
+	}
+	return NULL;
+}
+
+int jdice_simulate(const jap_diceroll* roll, uint64_t seed,
+		   unsigned long long trials, int nthreads, uint64_t* hist) {
+	int min, max;
+	jdice_range(roll, &min, &max);
+	size_t size = (size_t)max - min + 1;
+	if (nthreads < 1)
+		nthreads = 1;
+
+	/* Each thread counts into its own histogram, padded out to whole
+	 * cache lines, and writes nothing else, so that no two threads ever
+	 * write to the same line. */
+	size_t stride = (size * sizeof(uint64_t) + 63) / 64 * 64;
+	jdice__sim_job* jobs = (jdice__sim_job*)malloc(nthreads * sizeof(*jobs));
+	char* mem = (char*)calloc(1, nthreads * stride + 64);
+	if (jobs == NULL || mem == NULL) {
+		free(jobs);
+		free(mem);
+		return JAP_DICE_NOMEM;
+	}
+	char* base = mem + (64 - (uintptr_t)mem % 64) % 64;
+
+	jdice_rng rng;
+	jdice_seed(&rng, seed);
+	for (int i = 0; i < nthreads; i++) {
+		jobs[i].roll = *roll;
+		jobs[i].rng = rng;
+		jobs[i].trials = trials / nthreads +
+			((unsigned long long)i < trials % nthreads);
+		jobs[i].min = min;
+		jobs[i].last = max - min;
+		jobs[i].hist = (uint64_t*)(base + i * stride);
+		jdice_jump(&rng);
+	}
+
+#ifdef JAP_DICE_THREADS
+	pthread_t* threads = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+	int started = 0;
+	if (threads != NULL) {
+		for (; started < nthreads - 1; started++) {
+			if (pthread_create(&threads[started], NULL,
+					   jdice__sim_worker, &jobs[started]))
+				break;
+		}
+	}
+	/* Do the rest here, including any we couldn't start a thread for */
+	for (int i = started; i < nthreads; i++)
+		jdice__sim_worker(&jobs[i]);
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+#else
+	for (int i = 0; i < nthreads; i++)
+		jdice__sim_worker(&jobs[i]);
+#endif	/* JAP_DICE_THREADS */
+
+	for (size_t k = 0; k < size; k++) {
+		uint64_t total = 0;
+		for (int i = 0; i < nthreads; i++)
+			total += jobs[i].hist[k];
+		hist[k] = total;
+	}
+	free(jobs);
+	free(mem);
+	return 0;
+}
+
+// Internal helper function: the distribution of the sum of n dice that each
+// come up k with chance die[k] (0 <= k < len), by adding one die at a time.
+// Runs of equal chances in die are added all at once as differences of
+// running sums, so a plain die costs one pass over the result per die. out
+// needs room for n*(len-1)+1 chances, and tmp for one more than that.
+static void jdice__power_runs(const double* die, int len, int n, double* out,
+			      double* tmp) {
+	memcpy(out, die, (size_t)len * sizeof(double));
+	int have = len;
+	for (int d = 1; d < n; d++) {
+		/* tmp[i] is the chance of the sum so far being below i */
+		tmp[0] = 0;
+		for (int i = 0; i < have; i++)
+			tmp[i + 1] = tmp[i] + out[i];
+		int newlen = have + len - 1;
+		for (int k = 0; k < newlen; k++)
+			out[k] = 0;
+		for (int a = 0; a < len;) {
+			int b = a;
+			while (b + 1 < len && die[b + 1] == die[a])
+				b++;
+			if (die[a] > 0) {
+				/* Faces a..b, each adding die[a] times the chance
+				 * of the sum so far being in k-b..k-a */
+				for (int k = a; k < newlen; k++) {
+					int hi = k - a + 1 < have ? k - a + 1 : have;
+					int lo = k - b > 0 ? k - b : 0;
+					if (lo >= hi)
+						continue;
+					double p = tmp[hi] - tmp[lo];
+					if (p > 0)
+						out[k] += die[a] * p;
+				}
+			}
+			a = b + 1;
+		}
+		have = newlen;
+	}
+}
+
+#ifdef JAP_DICE_LARGE
+/* Smallest number of dice that jdice__power takes to the FFT */
+#define JDICE__FFT_MIN 32
+
+// Internal helper function: in-place radix-2 FFT of the size complex numbers
+// in re and im, or the inverse (without dividing by size) if inv is set. tw
+// holds exp(-2 pi i k / size) for 0 <= k < size/2.
+static void jdice__fft(double* re, double* im, int size, const double* twr,
+		       const double* twi, bool inv) {
+	for (int i = 1, j = 0; i < size; i++) {
+		int bit = size >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j) {
+			double t = re[i];
+			re[i] = re[j];
+			re[j] = t;
+			t = im[i];
+			im[i] = im[j];
+			im[j] = t;
+		}
+	}
+	for (int len = 2; len <= size; len <<= 1) {
+		int step = size / len;
+		for (int i = 0; i < size; i += len) {
+			for (int k = 0; k < len / 2; k++) {
+				double wr = twr[k * step];
+				double wi = inv ? -twi[k * step] : twi[k * step];
+				int a = i + k;
+				int b = a + len / 2;
+				double br = re[b] * wr - im[b] * wi;
+				double bi = re[b] * wi + im[b] * wr;
+				re[b] = re[a] - br;
+				im[b] = im[a] - bi;
+				re[a] += br;
+				im[a] += bi;
+			}
+		}
+	}
+}
+
+// Internal helper function: jdice__power_runs with an FFT: transform the die,
+// take each frequency to the nth power by squaring, and transform back. The
+// transform is at least as long as the result, so nothing wraps around.
+// Returns false if we ran out of memory.
+static bool jdice__power_fft(const double* die, int len, int n, double* out) {
+	long long span = (long long)n * (len - 1) + 1;
+	int size = 1;
+	while (size < span)
+		size <<= 1;
+	double* mem = (double*)malloc((size_t)size * 3 * sizeof(double));
+	if (mem == NULL)
+		return false;
+	double* re = mem;
+	double* im = mem + size;
+	double* twr = mem + 2 * (size_t)size;
+	double* twi = twr + size / 2;
+
+	double pi = acos(-1.0);
+	for (int k = 0; k < size / 2; k++) {
+		twr[k] = cos(2 * pi * k / size);
+		twi[k] = -sin(2 * pi * k / size);
+	}
+	for (int k = 0; k < size; k++) {
+		re[k] = k < len ? die[k] : 0;
+		im[k] = 0;
+	}
+	jdice__fft(re, im, size, twr, twi, false);
+	for (int k = 0; k < size; k++) {
+		double br = re[k], bi = im[k];
+		double rr = 1, ri = 0;
+		for (int e = n; e > 0; e >>= 1) {
+			double t;
+			if (e & 1) {
+				t = rr * br - ri * bi;
+				ri = rr * bi + ri * br;
+				rr = t;
+			}
+			t = br * br - bi * bi;
+			bi = 2 * br * bi;
+			br = t;
+		}
+		re[k] = rr;
+		im[k] = ri;
+	}
+	jdice__fft(re, im, size, twr, twi, true);
+	/* Rounding error can leave the far tails a hair below zero */
+	for (long long k = 0; k < span; k++)
+		out[k] = re[k] > 0 ? re[k] / size : 0;
+	free(mem);
+	return true;
+}
+#endif	/* JAP_DICE_LARGE */
+
+// Internal helper function: the distribution of the sum of n dice, as in
+// jdice__power_runs, into out. Returns false if we ran out of memory.
+static bool jdice__power(const double* die, int len, int n, double* out) {
+	if (len == 1) {
+		out[0] = 1;
+		return true;
+	}
+#ifdef JAP_DICE_LARGE
+	if (n >= JDICE__FFT_MIN)
+		return jdice__power_fft(die, len, n, out);
+#endif	/* JAP_DICE_LARGE */
+	double* tmp = (double*)malloc(((size_t)n * (len - 1) + 2) *
+				      sizeof(double));
+	if (tmp == NULL)
+		return false;
+	jdice__power_runs(die, len, n, out, tmp);
+	free(tmp);
+	return true;
+}
+
+// Internal helper function: the distribution of the number of explosions of
+// n X-sided exploding dice, cut off after k (so it adds up to a bit less than
+// 1), into e. Each die explodes a geometric number of times; adding one to
+// the count so far turns e[k] into (1-r) times the sum of e[j] r^(k-j).
+static void jdice__explosions_pmf(int n, int x, int k, double* e) {
+	double r = 1.0 / x;
+	e[0] = 1;
+	for (int i = 1; i <= k; i++)
+		e[i] = 0;
+	for (int d = 0; d < n; d++) {
+		double run = 0;
+		for (int i = 0; i <= k; i++) {
+			run = e[i] + r * run;
+			e[i] = (1 - r) * run;
+		}
+	}
+}
+
+// Internal helper function: works out the chance of each result of roll, from
+// jdice_range's min to its max. Returns a malloc'd array of *size chances, the
+// first of which is for the result *min, or NULL on failure (with the reason
+// in *err). The chance of anything past max is added to max.
+static double* jdice__pmf(const jap_diceroll* roll, int* min, int* size,
+			  int* err) {
+	int n = roll->n;
+	int x = roll->type == DFUDGE ? 3 : roll->x;
+	int t = roll->t;
+	bool ok = n >= 1 && x >= 1;
 	switch (roll->type) {
 	case DNDX:
-		return jdice_ndx_func(roll->n, roll->x, f, closure);
 	case DFUDGE:
-		return jdice_fudge_func(roll->n, f, closure);
 	case DMAX:
-		return jdice_max_func(roll->n, roll->x, f, closure);
+	case DMIN:
+		break;
+	case DSUCC:
+		ok = ok && t >= 1 && t <= x;
+		break;
+	case DEXPL:
+		ok = ok && x >= 2;
+		break;
+	case DXSUCC:
+		ok = ok && x >= 2 && t >= 1 && t <= x;
+		break;
+	case DREROLL:
+		ok = ok && t >= 1 && t < x;
+		break;
 	default:
-		return jdice_min_func(roll->n, roll->x, f, closure);
+		ok = false;
+	}
+	if (!ok) {
+		*err = JAP_DICE_PARSERR;
+		return NULL;
+	}
+
+	int max;
+	jdice_range(roll, min, &max);
+	long long span = (long long)max - *min + 1;
+	if (span > INT_MAX / (long long)sizeof(double)) {
+		*err = JAP_DICE_NOMEM;
+		return NULL;
 	}
+	double* pmf = (double*)malloc(span * sizeof(double));
+	/* One die's chances, or the parts of an exploding pool */
+	double* die = (double*)malloc((span + x) * sizeof(double));
+	if (pmf == NULL || die == NULL) {
+		free(pmf);
+		free(die);
+		*err = JAP_DICE_NOMEM;
+		return NULL;
+	}
+	*size = (int)span;
+	*err = 0;
+
+	switch (roll->type) {
+	case DNDX:
+	case DFUDGE:
+		for (int k = 0; k < x; k++)
+			die[k] = 1.0 / x;
+		if (!jdice__power(die, x, n, pmf))
+			*err = JAP_DICE_NOMEM;
+		break;
+	case DREROLL:
+		/* Faces up to t come up only on the reroll */
+		for (int k = 0; k < x; k++)
+			die[k] = (k < t ? t : x + t) / ((double)x * x);
+		if (!jdice__power(die, x, n, pmf))
+			*err = JAP_DICE_NOMEM;
+		break;
+	case DSUCC:
+		die[1] = (double)(x - t + 1) / x;
+		die[0] = 1 - die[1];
+		if (!jdice__power(die, 2, n, pmf))
+			*err = JAP_DICE_NOMEM;
+		break;
+	case DMAX:
+		for (int k = 1; k <= x; k++)
+			pmf[k - 1] = jdice__powi((double)k / x, n) -
+				jdice__powi((double)(k - 1) / x, n);
+		break;
+	case DMIN:
+		for (int k = 1; k <= x; k++)
+			pmf[k - 1] = jdice__powi((double)(x - k + 1) / x, n) -
+				jdice__powi((double)(x - k) / x, n);
+		break;
+	default: {
+		/* x times the explosions, plus dice that didn't explode: n
+		 * dice 1..x-1 for DEXPL, or successes among them for DXSUCC */
+		int scale = roll->type == DEXPL ? x : 1;
+		int k = (int)((span - 1 - (roll->type == DEXPL ?
+					   (long long)n * (x - 2) : n)) / scale);
+		int rest = (int)span - scale * k;
+		double* e = die + rest;
+		if (roll->type == DEXPL) {
+			for (int i = 0; i < x - 1; i++)
+				die[i] = 1.0 / (x - 1);
+			ok = jdice__power(die, x - 1, n, pmf);
+		} else {
+			die[1] = (double)(x - t) / (x - 1);
+			die[0] = 1 - die[1];
+			ok = jdice__power(die, 2, n, pmf);
+		}
+		if (!ok) {
+			*err = JAP_DICE_NOMEM;
+			break;
+		}
+		memcpy(die, pmf, (size_t)rest * sizeof(double));
+		jdice__explosions_pmf(n, x, k, e);
+		for (long long i = 0; i < span; i++)
+			pmf[i] = 0;
+		for (int j = 0; j <= k; j++)
+			for (int i = 0; i < rest; i++)
+				pmf[scale * j + i] += e[j] * die[i];
+		double total = 0;
+		for (long long i = 0; i < span; i++)
+			total += pmf[i];
+		if (total < 1)
+			pmf[span - 1] += 1 - total;
+	}
+	}
+	free(die);
+	if (*err != 0) {
+		free(pmf);
+		return NULL;
+	}
+	return pmf;
+}
+
+int jdice_pmf(const jap_diceroll* roll, double* pmf) {
+	int min, size, err;
+	double* p = jdice__pmf(roll, &min, &size, &err);
+	if (p == NULL)
+		return err;
+	memcpy(pmf, p, (size_t)size * sizeof(double));
+	free(p);
+	return 0;
+}
+
+int jdice_stats(const jap_diceroll* roll, jdice_stats_out* stats) {
+	int size, err;
+	double* pmf = jdice__pmf(roll, &stats->min, &size, &err);
+	if (pmf == NULL)
+		return err;
+	stats->max = stats->min + size - 1;
+
+	double mean = 0;
+	for (int i = 0; i < size; i++)
+		mean += pmf[i] * (stats->min + i);
+	double var = 0;
+	for (int i = 0; i < size; i++) {
+		double d = stats->min + i - mean;
+		var += pmf[i] * d * d;
+	}
+
+	/* The tails of exploding dice were cut off; do those properly. Each
+	 * die explodes 1/(x-1) times on average, with variance x/(x-1)^2. */
+	double x = roll->x;
+	double em = 1 / (x - 1);
+	double ev = x / ((x - 1) * (x - 1));
+	if (roll->type == DEXPL) {
+		mean = roll->n * (x * em + x / 2);
+		var = roll->n * (x * x * ev + ((x - 1) * (x - 1) - 1) / 12);
+	} else if (roll->type == DXSUCC) {
+		double p = (x - roll->t) / (x - 1);
+		mean = roll->n * (em + p);
+		var = roll->n * (ev + p * (1 - p));
+	}
+	stats->mean = mean;
+	stats->variance = var;
+
+	/* Turn the chances into the CDF in place */
+	double total = 0;
+	for (int i = 0; i < size; i++) {
+		total += pmf[i];
+		pmf[i] = total < 1 ? total : 1;
+	}
+	pmf[size - 1] = 1;
+	stats->cdf = pmf;
+	return 0;
+}
+
+double jdice_cdf(const jdice_stats_out* stats, int k) {
+	if (k < stats->min)
+		return 0;
+	if (k >= stats->max)
+		return 1;
+	return stats->cdf[k - stats->min];
+}
+
+int jdice_quantile(const jdice_stats_out* stats, double p) {
+	int lo = 0;
+	int hi = stats->max - stats->min;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (stats->cdf[mid] >= p)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return stats->min + lo;
+}
+
+void jdice_stats_free(jdice_stats_out* stats) {
+	free(stats->cdf);
+	stats->cdf = NULL;
+}
+
+int jdice_compile(const jap_diceroll* roll, jdice_sampler* sampler) {
+	int min, size, err;
+	double* pmf = jdice__pmf(roll, &min, &size, &err);
+	if (pmf == NULL)
+		return err;
+
+	/* Both tables, then a work list of slots, all in one go */
+	char* mem = (char*)malloc((size_t)size * (sizeof(uint32_t) +
+						  sizeof(int32_t) + sizeof(int)));
+	if (mem == NULL) {
+		free(pmf);
+		return JAP_DICE_NOMEM;
+	}
+	uint32_t* prob = (uint32_t*)mem;
+	int32_t* alias = (int32_t*)(mem + (size_t)size * sizeof(uint32_t));
+	int* work = (int*)(mem + (size_t)size * (sizeof(uint32_t) +
+						 sizeof(int32_t)));
+
+	/* Vose's method: slots under the mean go on the bottom of the work
+	 * list, slots over it on top, and each under-full slot is topped up
+	 * from an over-full one. */
+	int nsmall = 0;
+	int nlarge = 0;
+	for (int i = 0; i < size; i++) {
+		pmf[i] *= size;
+		if (pmf[i] < 1)
+			work[nsmall++] = i;
+		else
+			work[size - ++nlarge] = i;
+	}
+	while (nsmall > 0 && nlarge > 0) {
+		int l = work[--nsmall];
+		int g = work[size - nlarge];
+		prob[l] = (uint32_t)(pmf[l] * 4294967296.0);
+		alias[l] = g;
+		pmf[g] -= 1 - pmf[l];
+		if (pmf[g] < 1) {
+			nlarge--;
+			work[nsmall++] = g;
+		}
+	}
+	/* Whatever's left is full, give or take rounding error */
+	while (nsmall > 0) {
+		int i = work[--nsmall];
+		prob[i] = UINT32_MAX;
+		alias[i] = i;
+	}
+	while (nlarge > 0) {
+		int i = work[size - nlarge--];
+		prob[i] = UINT32_MAX;
+		alias[i] = i;
+	}
+	free(pmf);
+
+	sampler->min = min;
+	sampler->size = size;
+	sampler->reject = -(uint32_t)size % (uint32_t)size;
+	sampler->prob = prob;
+	sampler->alias = alias;
+	sampler->mem = mem;
+	return 0;
+}
+
+int jdice_sample_r(jdice_rng* rng, const jdice_sampler* sampler) {
+	uint32_t s = (uint32_t)sampler->size;
+	uint32_t slot;
+	uint32_t coin;
+	if (rng == NULL) {
+		slot = (uint32_t)jdice__rand(NULL, (int)s);
+		coin = jdice__bits32(NULL);
+	} else {
+		/* One draw: the top half picks the slot, the bottom half is
+		 * the coin flip between it and its alias. */
+		uint64_t r = jdice__next(rng);
+		uint64_t m = (r >> 32) * s;
+		while ((uint32_t)m < sampler->reject) {
+			r = jdice__next(rng);
+			m = (r >> 32) * s;
+		}
+		slot = (uint32_t)(m >> 32);
+		coin = (uint32_t)r;
+	}
+	if (coin >= sampler->prob[slot])
+		slot = (uint32_t)sampler->alias[slot];
+	return sampler->min + (int)slot;
+}
+
+int jdice_sample(const jdice_sampler* sampler) {
+	return jdice_sample_r(NULL, sampler);
+}
+
+void jdice_sampler_free(jdice_sampler* sampler) {
+	free(sampler->mem);
+	sampler->mem = NULL;
+	sampler->prob = NULL;
+	sampler->alias = NULL;
+}
+
+/* Version of the sampler table file format */
+#define JDICE__TABLE_VERSION 1
+
+// Internal type: the start of a sampler table file. It's followed by count
+// jdice__table_entry, then each sampler's prob and alias tables, all in the
+// writer's byte order; order tells the loader what that was.
+typedef struct {
+	char magic[8];		/* "JDICETBL" */
+	uint32_t version;	/* JDICE__TABLE_VERSION */
+	uint32_t order;		/* 0x01020304 */
+	uint32_t count;		/* Number of entries */
+	uint32_t reserved;
+	uint64_t length;	/* Length of the whole file */
+} jdice__table_header;
+
+// Internal type: one roll in a sampler table file.
+typedef struct {
+	int32_t type;
+	int32_t n;
+	int32_t x;
+	int32_t t;
+	int32_t min;
+	int32_t size;
+	uint32_t reject;
+	uint32_t reserved;
+	uint64_t offset;	/* Where prob starts; alias follows it */
+} jdice__table_entry;
+
+int jdice_table_write(const char* path, const jap_diceroll* rolls, int count) {
+	if (count < 0)
+		return JAP_DICE_PARSERR;
+	jdice_sampler* samplers = (jdice_sampler*)malloc(
+		((size_t)count + 1) * sizeof(jdice_sampler));
+	jdice__table_entry* entries = (jdice__table_entry*)malloc(
+		((size_t)count + 1) * sizeof(jdice__table_entry));
+	int err = samplers == NULL || entries == NULL ? JAP_DICE_NOMEM : 0;
+	int done = 0;
+
+	uint64_t offset = sizeof(jdice__table_header) +
+		(uint64_t)count * sizeof(jdice__table_entry);
+	for (; err == 0 && done < count; done++) {
+		err = jdice_compile(&rolls[done], &samplers[done]);
+		if (err != 0)
+			break;
+		jdice__table_entry* e = &entries[done];
+		e->type = (int32_t)rolls[done].type;
+		e->n = rolls[done].n;
+		e->x = rolls[done].type == DFUDGE ? 3 : rolls[done].x;
+		e->t = rolls[done].t;
+		e->min = samplers[done].min;
+		e->size = samplers[done].size;
+		e->reject = samplers[done].reject;
+		e->reserved = 0;
+		e->offset = offset;
+		offset += (uint64_t)e->size * (sizeof(uint32_t) +
+					       sizeof(int32_t));
+	}
+
+	FILE* f = NULL;
+	if (err == 0) {
+		jdice__table_header h;
+		memcpy(h.magic, "JDICETBL", 8);
+		h.version = JDICE__TABLE_VERSION;
+		h.order = 0x01020304;
+		h.count = (uint32_t)count;
+		h.reserved = 0;
+		h.length = offset;
+
+		f = fopen(path, "wb");
+		bool ok = f != NULL &&
+			fwrite(&h, sizeof(h), 1, f) == 1 &&
+			fwrite(entries, sizeof(jdice__table_entry),
+			       (size_t)count, f) == (size_t)count;
+		for (int i = 0; ok && i < count; i++) {
+			size_t size = (size_t)samplers[i].size;
+			ok = fwrite(samplers[i].prob, sizeof(uint32_t), size,
+				    f) == size &&
+				fwrite(samplers[i].alias, sizeof(int32_t), size,
+				       f) == size;
+		}
+		if (f != NULL && fclose(f) != 0)
+			ok = false;
+		if (!ok)
+			err = JAP_DICE_IOERR;
+	}
+
+	for (int i = 0; i < done; i++)
+		jdice_sampler_free(&samplers[i]);
+	free(samplers);
+	free(entries);
+	return err;
+}
+
+// Internal helper function: read the whole file at path, mapped if we can.
+// Returns null if we couldn't, with the reason in *err.
+static void* jdice__table_read(const char* path, size_t* length, int* err) {
+	*err = JAP_DICE_IOERR;
+#ifdef JDICE__MMAP
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	void* data = NULL;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		*length = (size_t)st.st_size;
+		data = mmap(NULL, *length, PROT_READ, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED)
+			data = NULL;
+	}
+	close(fd);
+	return data;
+#else
+	FILE* f = fopen(path, "rb");
+	if (f == NULL)
+		return NULL;
+	void* data = NULL;
+	long len;
+	if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) > 0 &&
+	    fseek(f, 0, SEEK_SET) == 0) {
+		*length = (size_t)len;
+		data = malloc(*length);
+		if (data == NULL) {
+			*err = JAP_DICE_NOMEM;
+		} else if (fread(data, 1, *length, f) != *length) {
+			free(data);
+			data = NULL;
+		}
+	}
+	fclose(f);
+	return data;
+#endif	/* JDICE__MMAP */
+}
+
+// Internal helper function: undo jdice__table_read.
+static void jdice__table_unread(const void* data, size_t length) {
+#ifdef JDICE__MMAP
+	munmap((void*)data, length);
+#else
+	(void)length;
+	free((void*)data);
+#endif	/* JDICE__MMAP */
+}
+
+int jdice_table_load(const char* path, jdice_table* table) {
+	int err;
+	size_t length = 0;
+	const char* data = (const char*)jdice__table_read(path, &length, &err);
+	if (data == NULL)
+		return err;
+
+	/* Check that everything the header and entries say is in the file */
+	jdice__table_header h;
+	bool ok = length >= sizeof(h);
+	if (ok) {
+		memcpy(&h, data, sizeof(h));
+		ok = memcmp(h.magic, "JDICETBL", 8) == 0 &&
+			h.version == JDICE__TABLE_VERSION &&
+			h.order == 0x01020304 && h.length == length &&
+			h.count <= (length - sizeof(h)) /
+			sizeof(jdice__table_entry);
+	}
+	const jdice__table_entry* entries =
+		(const jdice__table_entry*)(data + sizeof(h));
+	for (uint32_t i = 0; ok && i < h.count; i++) {
+		const jdice__table_entry* e = &entries[i];
+		ok = e->size >= 1 && e->offset % sizeof(uint32_t) == 0 &&
+			e->offset <= length &&
+			(uint64_t)e->size <= (length - e->offset) /
+			(sizeof(uint32_t) + sizeof(int32_t));
+	}
+	if (!ok) {
+		jdice__table_unread(data, length);
+		return JAP_DICE_PARSERR;
+	}
+
+	int count = (int)h.count;
+	char* mem = (char*)malloc(((size_t)count + 1) *
+				  (sizeof(jap_diceroll) + sizeof(jdice_sampler)));
+	if (mem == NULL) {
+		jdice__table_unread(data, length);
+		return JAP_DICE_NOMEM;
+	}
+	table->samplers = (jdice_sampler*)mem;
+	table->rolls = (jap_diceroll*)(mem + ((size_t)count + 1) *
+				       sizeof(jdice_sampler));
+	for (int i = 0; i < count; i++) {
+		const jdice__table_entry* e = &entries[i];
+		table->rolls[i].type = (jap_dice_type)e->type;
+		table->rolls[i].n = e->n;
+		table->rolls[i].x = e->x;
+		table->rolls[i].t = e->t;
+
+		/* The tables stay in the file */
+		jdice_sampler* s = &table->samplers[i];
+		s->min = e->min;
+		s->size = e->size;
+		s->reject = e->reject;
+		s->prob = (uint32_t*)(data + e->offset);
+		s->alias = (int32_t*)(data + e->offset +
+				      (size_t)e->size * sizeof(uint32_t));
+		s->mem = NULL;
+	}
+	table->count = count;
+	table->data = data;
+	table->length = length;
+	return 0;
+}
+
+int jdice_table_find(const jdice_table* table, const jap_diceroll* roll) {
+	for (int i = 0; i < table->count; i++) {
+		const jap_diceroll* r = &table->rolls[i];
+		if (r->type == roll->type && r->n == roll->n &&
+		    (r->type == DFUDGE || r->x == roll->x) && r->t == roll->t)
+			return i;
+	}
+	return -1;
+}
+
+void jdice_table_free(jdice_table* table) {
+	if (table->data != NULL)
+		jdice__table_unread(table->data, table->length);
+	free(table->samplers);
+	table->data = NULL;
+	table->samplers = NULL;
+	table->rolls = NULL;
+	table->count = 0;
+}
+
+#ifdef JAP_DICE_LARGE
+int jdice_large_init(jdice_large* pool, jap_dice_type type, int64_t n, int x) {
+	if (type == DFUDGE)
+		x = 3;
+	if (n < 1 || x < 1 || type > DMIN)
+		return JAP_DICE_PARSERR;
+	pool->type = type;
+	pool->n = n;
+	pool->x = x;
+	pool->exact.mem = NULL;
+	if (type == DMAX || type == DMIN || n <= JAP_DICE_LARGE_DIRECT)
+		return 0;
+
+	if (n * (x - 1) + 1 <= JAP_DICE_LARGE_EXACT) {
+		jap_diceroll roll = {type, (int)n, x, 0};
+		return jdice_compile(&roll, &pool->exact);
+	}
+
+	/* Moments of one die, which is uniform on 1..x (or -1..1) */
+	double x2 = (double)x * x;
+	double mean = type == DFUDGE ? 0 : (x + 1) / 2.0;
+	double var = (x2 - 1) / 12;
+	double kurt = -6 * (x2 + 1) / (5 * (x2 - 1));
+	pool->mean = n * mean;
+	pool->sd = sqrt(n * var);
+	pool->kurt = kurt / n;
+	return 0;
+}
+
+int64_t jdice_large_roll_r(jdice_rng* rng, const jdice_large* pool) {
+	int64_t n = pool->n;
+	int x = pool->x;
+	switch (pool->type) {
+	case DMAX:
+		return jdice__max_closed(rng, n, x);
+	case DMIN:
+		return x + 1 - jdice__max_closed(rng, n, x);
+	default:
+		break;
+	}
+	if (pool->exact.mem != NULL)
+		return jdice_sample_r(rng, &pool->exact);
+
+	int64_t lo = pool->type == DFUDGE ? -n : n;
+	if (n <= JAP_DICE_LARGE_DIRECT) {
+		if (jdice__by_words(rng, n, x))
+			return lo + jdice__sum_words(rng, n, x);
+		int64_t result = lo;
+		for (int64_t i = 0; i < n; i++)
+			result += jdice__rand(rng, x);
+		return result;
+	}
+	if (x == 1)
+		return n;
+
+	/* Marsaglia's polar method for a standard normal z */
+	double u, v, r;
+	do {
+		u = 2 * jdice__unit(rng) - 1;
+		v = 2 * jdice__unit(rng) - 1;
+		r = u * u + v * v;
+	} while (r >= 1 || r == 0);
+	double z = u * sqrt(-2 * log(r) / r);
+
+	/* Cornish-Fisher: the skew is 0, so only the kurtosis term is left */
+	z += pool->kurt / 24 * (z * z * z - 3 * z);
+	double result = floor(pool->mean + pool->sd * z + 0.5);
+	double hi = pool->type == DFUDGE ? (double)n : (double)n * x;
+	if (result < (double)lo)
+		return lo;
+	if (result > hi)
+		return (int64_t)hi;
+	return (int64_t)result;
+}
+
+int64_t jdice_large_roll(const jdice_large* pool) {
+	return jdice_large_roll_r(NULL, pool);
+}
+
+void jdice_large_free(jdice_large* pool) {
+	if (pool->exact.mem != NULL)
+		jdice_sampler_free(&pool->exact);
+}
+#endif	/* JAP_DICE_LARGE */
+
+/* Number of generator streams run side by side by the batch functions */
+#define JDICE__LANES 4
+
+/* Number of 64-bit words generated per refill of a batch stream */
+#define JDICE__STREAM_WORDS 64
+
+// Internal type: JDICE__LANES xoshiro256** generators, stored word-major so
+// that each state word of all the lanes fits in one AVX2 register, and a
+// buffer of their output, handed out 32 bits at a time.
+typedef struct {
+	uint64_t s[4][JDICE__LANES];
+	uint64_t buf[JDICE__STREAM_WORDS];
+	int pos;
+} jdice__stream;
+
+static void jdice__stream_init(jdice__stream* st, jdice_rng* rng) {
+	for (int lane = 0; lane < JDICE__LANES; lane++) {
+		jdice_rng seeded;
+		jdice_seed(&seeded, jdice__next(rng));
+		for (int i = 0; i < 4; i++)
+			st->s[i][lane] = seeded.s[i];
+	}
+	st->pos = 2 * JDICE__STREAM_WORDS;
+}
+
+#if !defined(JAP_DICE_NO_SIMD) && defined(__AVX2__)
+#define JDICE__ROTL256(x, k) \
+	_mm256_or_si256(_mm256_slli_epi64(x, k), _mm256_srli_epi64(x, 64 - (k)))
+
+static void jdice__stream_refill(jdice__stream* st) {
+	__m256i s0 = _mm256_loadu_si256((const __m256i*)st->s[0]);
+	__m256i s1 = _mm256_loadu_si256((const __m256i*)st->s[1]);
+	__m256i s2 = _mm256_loadu_si256((const __m256i*)st->s[2]);
+	__m256i s3 = _mm256_loadu_si256((const __m256i*)st->s[3]);
+	for (int i = 0; i < JDICE__STREAM_WORDS; i += JDICE__LANES) {
+		/* rotl(s1 * 5, 7) * 9, with the multiplies done as shifts */
+		__m256i r = _mm256_add_epi64(_mm256_slli_epi64(s1, 2), s1);
+		r = JDICE__ROTL256(r, 7);
+		r = _mm256_add_epi64(_mm256_slli_epi64(r, 3), r);
+		_mm256_storeu_si256((__m256i*)&st->buf[i], r);
+
+		__m256i t = _mm256_slli_epi64(s1, 17);
+		s2 = _mm256_xor_si256(s2, s0);
+		s3 = _mm256_xor_si256(s3, s1);
+		s1 = _mm256_xor_si256(s1, s2);
+		s0 = _mm256_xor_si256(s0, s3);
+		s2 = _mm256_xor_si256(s2, t);
+		s3 = JDICE__ROTL256(s3, 45);
+	}
+	_mm256_storeu_si256((__m256i*)st->s[0], s0);
+	_mm256_storeu_si256((__m256i*)st->s[1], s1);
+	_mm256_storeu_si256((__m256i*)st->s[2], s2);
+	_mm256_storeu_si256((__m256i*)st->s[3], s3);
+	st->pos = 0;
+}
+#elif !defined(JAP_DICE_NO_SIMD) && defined(__SSE2__)
+#define JDICE__ROTL128(x, k) \
+	_mm_or_si128(_mm_slli_epi64(x, k), _mm_srli_epi64(x, 64 - (k)))
+
+static void jdice__stream_refill(jdice__stream* st) {
+	/* Two registers hold the four lanes; lanes 0-1 in a, lanes 2-3 in b */
+	for (int half = 0; half < JDICE__LANES; half += 2) {
+		__m128i s0 = _mm_loadu_si128((const __m128i*)&st->s[0][half]);
+		__m128i s1 = _mm_loadu_si128((const __m128i*)&st->s[1][half]);
+		__m128i s2 = _mm_loadu_si128((const __m128i*)&st->s[2][half]);
+		__m128i s3 = _mm_loadu_si128((const __m128i*)&st->s[3][half]);
+		for (int i = 0; i < JDICE__STREAM_WORDS; i += JDICE__LANES) {
+			__m128i r = _mm_add_epi64(_mm_slli_epi64(s1, 2), s1);
+			r = JDICE__ROTL128(r, 7);
+			r = _mm_add_epi64(_mm_slli_epi64(r, 3), r);
+			_mm_storeu_si128((__m128i*)&st->buf[i + half], r);
+
+			__m128i t = _mm_slli_epi64(s1, 17);
+			s2 = _mm_xor_si128(s2, s0);
+			s3 = _mm_xor_si128(s3, s1);
+			s1 = _mm_xor_si128(s1, s2);
+			s0 = _mm_xor_si128(s0, s3);
+			s2 = _mm_xor_si128(s2, t);
+			s3 = JDICE__ROTL128(s3, 45);
+		}
+		_mm_storeu_si128((__m128i*)&st->s[0][half], s0);
+		_mm_storeu_si128((__m128i*)&st->s[1][half], s1);
+		_mm_storeu_si128((__m128i*)&st->s[2][half], s2);
+		_mm_storeu_si128((__m128i*)&st->s[3][half], s3);
+	}
+	st->pos = 0;
+}
+#else
+static void jdice__stream_refill(jdice__stream* st) {
+	for (int i = 0; i < JDICE__STREAM_WORDS; i += JDICE__LANES) {
+		for (int lane = 0; lane < JDICE__LANES; lane++) {
+			uint64_t* s0 = &st->s[0][lane];
+			uint64_t* s1 = &st->s[1][lane];
+			uint64_t* s2 = &st->s[2][lane];
+			uint64_t* s3 = &st->s[3][lane];
+			st->buf[i + lane] = jdice__rotl(*s1 * 5, 7) * 9;
+
+			uint64_t t = *s1 << 17;
+			*s2 ^= *s0;
+			*s3 ^= *s1;
+			*s1 ^= *s2;
+			*s0 ^= *s3;
+			*s2 ^= t;
+			*s3 = jdice__rotl(*s3, 45);
+		}
+	}
+	st->pos = 0;
+}
+#endif
+
+static inline uint32_t jdice__stream_next32(jdice__stream* st) {
+	if (st->pos == 2 * JDICE__STREAM_WORDS)
+		jdice__stream_refill(st);
+	uint64_t w = st->buf[st->pos >> 1];
+	return (uint32_t)(st->pos++ & 1 ? w >> 32 : w);
+}
+
+// Internal helper function: draw 0 <= X < s from the stream. t is the
+// rejection threshold, -s % s, worked out once per batch by the caller.
+static inline int jdice__stream_rand(jdice__stream* st, uint32_t s,
+				     uint32_t t) {
+#ifdef JAP_DICE_LEGACY_MOD
+	(void)t;
+	return (int)(jdice__stream_next32(st) % s);
+#else
+	if ((s & (s - 1)) == 0)
+		return (int)(jdice__stream_next32(st) & (s - 1));
+
+	uint64_t m;
+	do {
+		m = (uint64_t)jdice__stream_next32(st) * s;
+	} while ((uint32_t)m < t);
+	return (int)(m >> 32);
+#endif	/* JAP_DICE_LEGACY_MOD */
+}
+
+void jdice_roll_batch_r(jdice_rng* rng, const jap_diceroll* roll, int* out,
+			size_t count) {
+	if (rng == NULL || roll->type > DMIN) {
+		/* Dice pools draw from distributions, not streams of faces */
+		for (size_t i = 0; i < count; i++)
+			out[i] = jdice_roll_r(rng, (jap_diceroll*)roll);
+		return;
+	}
+
+	jdice__stream st;
+	jdice__stream_init(&st, rng);
+	int n = roll->n;
+	uint32_t s = roll->type == DFUDGE ? 3 : (uint32_t)roll->x;
+	uint32_t t = -s % s;
+
+	switch (roll->type) {
+	case DNDX:
+		for (size_t i = 0; i < count; i++) {
+			int result = n;
+			for (int j = 0; j < n; j++)
+				result += jdice__stream_rand(&st, s, t);
+			out[i] = result;
+		}
+		break;
+	case DFUDGE:
+		for (size_t i = 0; i < count; i++) {
+			int result = -n;
+			for (int j = 0; j < n; j++)
+				result += jdice__stream_rand(&st, s, t);
+			out[i] = result;
+		}
+		break;
+	case DMAX:
+		for (size_t i = 0; i < count; i++) {
+			int result = -1;
+			for (int j = 0; j < n; j++) {
+				int face = jdice__stream_rand(&st, s, t);
+				if (face > result)
+					result = face;
+			}
+			out[i] = result + 1;
+		}
+		break;
+	default:
+		for (size_t i = 0; i < count; i++) {
+			int result = INT_MAX - 1;
+			for (int j = 0; j < n; j++) {
+				int face = jdice__stream_rand(&st, s, t);
+				if (face < result)
+					result = face;
+			}
+			out[i] = result + 1;
+		}
+	}
+}
+
+int jdice_faces_batch_r(jdice_rng* rng, size_t n, int x, uint8_t* out) {
+	if (x < 1 || x > UINT8_MAX)
+		return JAP_DICE_PARSERR;
+	if (rng == NULL) {
+		for (size_t i = 0; i < n; i++)
+			out[i] = (uint8_t)(jdice__rand(NULL, x) + 1);
+		return 0;
+	}
+
+	jdice__stream st;
+	jdice__stream_init(&st, rng);
+	uint32_t s = (uint32_t)x;
+	uint32_t t = -s % s;
+	for (size_t i = 0; i < n; i++)
+		out[i] = (uint8_t)(jdice__stream_rand(&st, s, t) + 1);
+	return 0;
+}
+
+void jdice_roll_batch(const jap_diceroll* roll, int* out, size_t count) {
+	jdice_rng rng;
+	jdice_seed(&rng, jdice__word(NULL));
+	jdice_roll_batch_r(&rng, roll, out, count);
+}
+
+int jdice_faces_batch(size_t n, int x, uint8_t* out) {
+	jdice_rng rng;
+	jdice_seed(&rng, jdice__word(NULL));
+	return jdice_faces_batch_r(&rng, n, x, out);
 }
 
 int jdice_parse_and_roll(const char* s) {
@@ -314,5 +2817,396 @@ int jdice_parse_and_roll(const char* s) {
 	return jdice_roll(&roll);
 }
 
+void jdice_cache_init(jdice_cache* cache) {
+	memset(cache, 0, sizeof(*cache));
+}
+
+int jdice_cache_parse(jdice_cache* cache, const char* s, jap_diceroll* roll) {
+	size_t len = 0;
+	uint32_t hash = 2166136261u;
+	while (s[len] != 0) {
+		if (len == JAP_DICE_CACHE_KEY) {
+			/* Too long to keep */
+			cache->misses++;
+			return jdice_parse(s, roll);
+		}
+		hash = (hash ^ (uint8_t)s[len++]) * 16777619u;
+	}
+
+	/* Entries are never removed, only replaced, so an empty slot means
+	 * the key isn't in the window. */
+	size_t start = hash & (JAP_DICE_CACHE_SIZE - 1) &
+		       ~(JDICE__CACHE_PROBE - 1);
+	jdice_cache_entry* window = &cache->slot[start];
+	jdice_cache_entry* e = NULL;
+	for (int i = 0; i < JDICE__CACHE_PROBE; i++) {
+		jdice_cache_entry* cand = &window[i];
+		if (!cand->used) {
+			e = cand;
+			break;
+		}
+		if (cand->hash == hash && cand->len == len &&
+		    memcmp(cand->key, s, len) == 0) {
+			cache->hits++;
+			cand->ref = true;
+			if (roll != NULL && cand->res == 0)
+				*roll = cand->roll;
+			return cand->res;
+		}
+	}
+
+	if (e == NULL) {
+		/* Window's full; move its hand on to an entry that hasn't
+		 * been hit since the hand last passed, giving the others a
+		 * second chance, and leave the hand just past it. */
+		uint8_t* hand = &cache->hand[start / JDICE__CACHE_PROBE];
+		while (e == NULL) {
+			jdice_cache_entry* cand = &window[*hand];
+			*hand = (uint8_t)((*hand + 1) % JDICE__CACHE_PROBE);
+			if (cand->ref)
+				cand->ref = false;
+			else
+				e = cand;
+		}
+	}
+
+	cache->misses++;
+	e->res = jdice_parse(s, &e->roll);
+	e->hash = hash;
+	e->used = true;
+	e->ref = false;
+	e->len = (uint8_t)len;
+	memcpy(e->key, s, len);
+	if (roll != NULL && e->res == 0)
+		*roll = e->roll;
+	return e->res;
+}
+
+int jdice_cache_parse_and_roll(jdice_cache* cache, const char* s) {
+	jap_diceroll roll;
+	int res = jdice_cache_parse(cache, s, &roll);
+	if (res)
+		return res;
+	return jdice_roll(&roll);
+}
+
+/* Instructions for jdice_prog. Each is one word, followed by its operands. */
+enum {
+	JDICE__OP_CONST,	/* value: push value */
+	JDICE__OP_NDX,		/* n, x: push NdX */
+	JDICE__OP_FUDGE,	/* n: push NdF */
+	JDICE__OP_KEEPHI,	/* n, x, m: push the best m of NdX */
+	JDICE__OP_KEEPLO,	/* n, x, m: push the worst m of NdX */
+	JDICE__OP_NEG,
+	JDICE__OP_ADD,
+	JDICE__OP_SUB,
+	JDICE__OP_MUL,
+	JDICE__OP_DIV
+};
+
+// Internal type: state of the expression compiler.
+typedef struct {
+	const char* s;
+	jdice_prog* prog;
+	int len;
+	int depth;
+	int nesting;
+	bool bad;	/* Seen a number that's too big */
+	int last;	/* Start of the last instruction, or -1 */
+	int prev;	/* Start of the one before that, or -1 */
+} jdice__cc;
+
+// Internal helper function: append an instruction with nargs operands.
+// Returns false if the program would be too long or need too much stack.
+static bool jdice__emit(jdice__cc* cc, int op, int nargs, const int* args,
+			int push) {
+	if (cc->len + 1 + nargs > JAP_DICE_PROG_MAX ||
+	    cc->depth + push > JAP_DICE_STACK_MAX)
+		return false;
+	cc->prog->code[cc->len] = op;
+	for (int i = 0; i < nargs; i++)
+		cc->prog->code[cc->len + 1 + i] = args[i];
+	cc->prev = cc->last;
+	cc->last = cc->len;
+	cc->len += 1 + nargs;
+	cc->depth += push;
+	return true;
+}
+
+// Internal helper function: append a binary operator, folding it into a
+// constant if both operands are constants.
+static bool jdice__emit_binop(jdice__cc* cc, int op) {
+	int32_t* code = cc->prog->code;
+	if (cc->prev >= 0 &&
+	    code[cc->prev] == JDICE__OP_CONST &&
+	    code[cc->last] == JDICE__OP_CONST) {
+		uint32_t a = (uint32_t)code[cc->prev + 1];
+		uint32_t b = (uint32_t)code[cc->last + 1];
+		uint32_t result;
+		switch (op) {
+		case JDICE__OP_ADD:
+			result = a + b;
+			break;
+		case JDICE__OP_SUB:
+			result = a - b;
+			break;
+		case JDICE__OP_MUL:
+			result = a * b;
+			break;
+		default:
+			if ((int32_t)b == 0 || (int32_t)b == -1)
+				result = (int32_t)b == 0 ? 0 : 0 - a;
+			else
+				result = (uint32_t)((int32_t)a / (int32_t)b);
+		}
+		code[cc->prev + 1] = (int32_t)result;
+		cc->len = cc->last;
+		cc->last = cc->prev;
+		cc->prev = -1;
+		cc->depth--;
+		return true;
+	}
+	return jdice__emit(cc, op, 0, NULL, -1);
+}
+
+static void jdice__cc_space(jdice__cc* cc) {
+	while (*cc->s == ' ' || *cc->s == '\t' || *cc->s == '\n' ||
+	       *cc->s == '\r')
+		cc->s++;
+}
+
+// Internal helper function: read a number into *num. Returns false if there
+// isn't one; numbers bigger than max set cc->bad.
+static bool jdice__cc_number(jdice__cc* cc, int* num, int max) {
+	const char* start = cc->s;
+	int n = 0;
+	while ('0' <= *cc->s && *cc->s <= '9') {
+		int digit = *cc->s++ - '0';
+		if (n > (max - digit) / 10) {
+			cc->bad = true;
+			n = max;
+		} else {
+			n = (10 * n) + digit;
+		}
+	}
+	if (cc->s == start)
+		return false;
+	*num = n;
+	return true;
+}
+
+static bool jdice__cc_expr(jdice__cc* cc);
+
+// Internal helper function: compile the dice part of a term, just after the
+// d or D, given the number of dice n.
+static bool jdice__cc_dice(jdice__cc* cc, int n, bool traveller) {
+	int x;
+	if (*cc->s == 'F' || *cc->s == 'f') {
+		cc->s++;
+		return jdice__emit(cc, JDICE__OP_FUDGE, 1, &n, 1);
+	} else if (*cc->s == '%') {
+		cc->s++;
+		x = 100;
+	} else if (!jdice__cc_number(cc, &x, JAP_DICE_MAX)) {
+		if (!traveller)
+			return false;
+		x = 6;
+	}
+	if (x == 0)
+		return false;
+
+	/* Keep or drop? */
+	char c = cc->s[0];
+	char which = cc->s[1];
+	bool keep = c == 'k' || c == 'K';
+	if (!keep && !((c == 'd' || c == 'D') &&
+		       (which == 'h' || which == 'l'))) {
+		int nx[] = {n, x};
+		return jdice__emit(cc, JDICE__OP_NDX, 2, nx, 1);
+	}
+
+	cc->s++;
+	bool high = true;
+	if (*cc->s == 'h' || *cc->s == 'l') {
+		high = *cc->s == 'h';
+		cc->s++;
+	}
+	int m;
+	if (!jdice__cc_number(cc, &m, JAP_DICE_MAX) || m > n || x > JAP_DICE_KEEP_MAX ||
+	    (keep && m == 0))
+		return false;
+	if (!keep) {
+		/* Dropping the best m is keeping the worst n-m, and so on */
+		m = n - m;
+		high = !high;
+	}
+	int args[] = {n, x, m};
+	return jdice__emit(cc, high ? JDICE__OP_KEEPHI : JDICE__OP_KEEPLO, 3,
+			   args, 1);
+}
+
+static bool jdice__cc_primary(jdice__cc* cc) {
+	jdice__cc_space(cc);
+	char c = *cc->s;
+	if (c == '(' || c == '-' || c == '+') {
+		/* Don't let silly input run us out of C stack */
+		if (++cc->nesting > JAP_DICE_PROG_MAX)
+			return false;
+		cc->s++;
+		if (c == '(') {
+			if (!jdice__cc_expr(cc))
+				return false;
+			jdice__cc_space(cc);
+			if (*cc->s != ')')
+				return false;
+			cc->s++;
+		} else {
+			if (!jdice__cc_primary(cc))
+				return false;
+			if (c == '-' && cc->prog->code[cc->last] ==
+			    JDICE__OP_CONST) {
+				int32_t* v = &cc->prog->code[cc->last + 1];
+				*v = (int32_t)(0 - (uint32_t)*v);
+			} else if (c == '-' &&
+				   !jdice__emit(cc, JDICE__OP_NEG, 0, NULL, 0)) {
+				return false;
+			}
+		}
+		cc->nesting--;
+		return true;
+	}
+
+	/* Only dice counts are limited to JAP_DICE_MAX, not constants */
+	int n = 1;
+	bool seenn = jdice__cc_number(cc, &n, INT_MAX);
+	if (*cc->s == 'd' || *cc->s == 'D') {
+		if (seenn && (n == 0 || n > JAP_DICE_MAX))
+			return false;
+		bool traveller = *cc->s == 'D';
+		cc->s++;
+		return jdice__cc_dice(cc, n, traveller);
+	}
+	return seenn && jdice__emit(cc, JDICE__OP_CONST, 1, &n, 1);
+}
+
+static bool jdice__cc_term(jdice__cc* cc) {
+	if (!jdice__cc_primary(cc))
+		return false;
+	for (;;) {
+		jdice__cc_space(cc);
+		char c = *cc->s;
+		if (c != '*' && c != '/')
+			return true;
+		cc->s++;
+		if (!jdice__cc_primary(cc) ||
+		    !jdice__emit_binop(cc, c == '*' ? JDICE__OP_MUL :
+				       JDICE__OP_DIV))
+			return false;
+	}
+}
+
+static bool jdice__cc_expr(jdice__cc* cc) {
+	if (!jdice__cc_term(cc))
+		return false;
+	for (;;) {
+		jdice__cc_space(cc);
+		char c = *cc->s;
+		if (c != '+' && c != '-')
+			return true;
+		cc->s++;
+		if (!jdice__cc_term(cc) ||
+		    !jdice__emit_binop(cc, c == '+' ? JDICE__OP_ADD :
+				       JDICE__OP_SUB))
+			return false;
+	}
+}
+
+int jdice_expr_compile(const char* s, jdice_prog* prog) {
+	jdice_prog dry;
+	jdice__cc cc = {s, prog != NULL ? prog : &dry, 0, 0, 0, false, -1, -1};
+	if (!jdice__cc_expr(&cc) || cc.bad || *cc.s != 0)
+		return JAP_DICE_PARSERR;
+	cc.prog->len = cc.len;
+	return 0;
+}
+
+// Internal helper function: roll NdX and add up the best (or worst) m dice,
+// by counting how many of each face came up.
+static int jdice__keep(jdice_rng* rng, int n, int x, int m, bool high) {
+	int count[JAP_DICE_KEEP_MAX + 1];
+	memset(count, 0, (x + 1) * sizeof(int));
+	for (int i = 0; i < n; i++)
+		count[jdice__rand(rng, x) + 1]++;
+
+	int result = 0;
+	for (int i = 0; i < x && m > 0; i++) {
+		int face = high ? x - i : i + 1;
+		int take = count[face] < m ? count[face] : m;
+		result += take * face;
+		m -= take;
+	}
+	return result;
+}
+
+int jdice_expr_eval_r(jdice_rng* rng, const jdice_prog* prog) {
+	int32_t stack[JAP_DICE_STACK_MAX];
+	int32_t* sp = stack;
+	const int32_t* pc = prog->code;
+	const int32_t* end = pc + prog->len;
+
+	/* Arithmetic is done on 32-bit unsigned values, so it wraps rather
+	 * than overflowing, just as jdice__emit_binop folds constants */
+	while (pc < end) {
+		switch (*pc++) {
+		case JDICE__OP_CONST:
+			*sp++ = *pc++;
+			break;
+		case JDICE__OP_NDX:
+			*sp++ = jdice_ndx_r(rng, pc[0], pc[1]);
+			pc += 2;
+			break;
+		case JDICE__OP_FUDGE:
+			*sp++ = jdice_fudge_r(rng, *pc++);
+			break;
+		case JDICE__OP_KEEPHI:
+			*sp++ = jdice__keep(rng, pc[0], pc[1], pc[2], true);
+			pc += 3;
+			break;
+		case JDICE__OP_KEEPLO:
+			*sp++ = jdice__keep(rng, pc[0], pc[1], pc[2], false);
+			pc += 3;
+			break;
+		case JDICE__OP_NEG:
+			sp[-1] = (int32_t)(0 - (uint32_t)sp[-1]);
+			break;
+		case JDICE__OP_ADD:
+			sp--;
+			sp[-1] = (int32_t)((uint32_t)sp[-1] + (uint32_t)sp[0]);
+			break;
+		case JDICE__OP_SUB:
+			sp--;
+			sp[-1] = (int32_t)((uint32_t)sp[-1] - (uint32_t)sp[0]);
+			break;
+		case JDICE__OP_MUL:
+			sp--;
+			sp[-1] = (int32_t)((uint32_t)sp[-1] * (uint32_t)sp[0]);
+			break;
+		default:
+			sp--;
+			if (sp[0] == 0)
+				sp[-1] = 0;
+			else if (sp[0] == -1)
+				sp[-1] = (int32_t)(0 - (uint32_t)sp[-1]);
+			else
+				sp[-1] /= sp[0];
+		}
+	}
+	return (int)stack[0];
+}
+
+int jdice_expr_eval(const jdice_prog* prog) {
+	return jdice_expr_eval_r(NULL, prog);
+}
+
 #endif	/* JAP_DICE_IMP */
 #endif	/* _JAP_DICE_H */
@@ -0,0 +1,292 @@
+/*
+ * Dice Library, C++ Edition
+ * =========================
+ *
+ * Compile-time dice for C++17, on top of jap_dice.h. If you roll the same
+ * dice everywhere, e.g. "3d6", write them as "3d6"_dice instead of parsing
+ * them every time:
+ *
+ *	using namespace jdice::literals;
+ *	constexpr auto stat = "3d6"_dice;
+ *	int str = stat(&rng);
+ *
+ * The string is parsed by the compiler, with the same rules as jdice_parse,
+ * and a string that doesn't parse is a compile error. The result is an empty
+ * jdice::dice<type, n, x, t>, so the dice are part of its type; rolling it
+ * runs a kernel with n and x built in, so small pools are unrolled and
+ * reducing random numbers to 1..x takes no divisions. With the same rng it
+ * rolls exactly what jdice_roll_r would.
+ *
+ * The literal is a string literal operator template, which GCC and Clang
+ * support as an extension; with other compilers, parse with jdice::parse in
+ * a constexpr and name the jdice::dice type yourself.
+ *
+ * The implementation is still jap_dice.h's; #define JAP_DICE_IMP in one of
+ * your objects before including either header.
+ *
+ * This file is licensed under the MIT License; see the file LICENSE for
+ * details.
+ */
+
+#ifndef _JAP_DICE_HPP
+#define _JAP_DICE_HPP 1
+
+#include "jap_dice.h"
+
+#ifndef JAP_DICE_MAX
+#define JAP_DICE_MAX 1000
+#endif	/* JAP_DICE_MAX */
+
+namespace jdice {
+
+/* The result of parsing dice at compile time; err is 0 or JAP_DICE_PARSERR */
+struct parsed {
+	int err;
+	jap_dice_type type;
+	int n;
+	int x;
+	int t;
+};
+
+namespace detail {
+
+// Internal helper function: whether c is whitespace to jdice_parse.
+constexpr bool space(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Internal helper function: a failed parse.
+constexpr parsed error() {
+	return parsed{JAP_DICE_PARSERR, DNDX, 0, 0, 0};
+}
+
+// Internal helper function: num followed by the digits at s[*i], with *i
+// moved past them. Numbers past JAP_DICE_MAX come out as JAP_DICE_MAX+1.
+constexpr int number(const char* s, size_t len, size_t* i, long long num) {
+	for (; *i < len && '0' <= s[*i] && s[*i] <= '9'; (*i)++) {
+		num = 10 * num + (s[*i] - '0');
+		if (num > JAP_DICE_MAX)
+			num = JAP_DICE_MAX + 1;
+	}
+	return (int)num;
+}
+
+// Internal helper function: the rest of s from i is only whitespace.
+constexpr bool blank(const char* s, size_t len, size_t i) {
+	for (; i < len; i++)
+		if (!space(s[i]))
+			return false;
+	return true;
+}
+
+// Internal helper function: the dice pool suffix of NdX at s[i], as in
+// jdice__parse_pool.
+constexpr parsed pool(const char* s, size_t len, size_t i, int n, int x) {
+	jap_dice_type type = DREROLL;
+	if (s[i] == '!')
+		type = DEXPL;
+	else if (s[i] == '>')
+		type = DSUCC;
+	int t = 0;
+	i++;
+	if (type == DEXPL) {
+		if (x < 2)
+			return error();
+		size_t j = i;
+		while (j < len && space(s[j]))
+			j++;
+		if (j < len && s[j] == '>') {
+			type = DXSUCC;
+			i = j + 1;
+		}
+	}
+	if (type != DEXPL) {
+		while (i < len && space(s[i]))
+			i++;
+		if (i == len || s[i] < '0' || s[i] > '9')
+			return error();
+		t = number(s, len, &i, 0);
+		if (t < 1 || (type == DREROLL ? t >= x : t > x))
+			return error();
+	}
+	if (!blank(s, len, i))
+		return error();
+	return parsed{0, type, n, x, t};
+}
+
+}	/* namespace detail */
+
+/* Parse the len bytes at s like jdice_parse_n, at compile time if you like */
+constexpr parsed parse(const char* s, size_t len) {
+	int num = 0;
+	int n = 0;
+	bool seenn = false;
+	bool firstchr = true;
+	jap_dice_type type = DNDX;
+	for (size_t i = 0; i < len; i++) {
+		char ch = s[i];
+		switch (ch) {
+		case '+':
+		case '-':
+			if (!firstchr)
+				return detail::error();
+			type = ch == '+' ? DMAX : DMIN;
+			break;
+		case 'D':
+		case 'd':
+			if (num == 0 || num > JAP_DICE_MAX || seenn)
+				return detail::error();
+			n = num;
+			seenn = true;
+			num = 0;
+			if (ch == 'D') {
+				if (!detail::blank(s, len, i + 1))
+					return detail::error();
+				return parsed{0, type, n, 6, 0};
+			}
+			break;
+		case 'f':
+		case 'F':
+			if (!seenn || type != DNDX ||
+			    !detail::blank(s, len, i + 1))
+				return detail::error();
+			return parsed{0, DFUDGE, n, 3, 0};
+		case '!':
+		case '>':
+		case 'r':
+			if (!seenn || type != DNDX || num == 0 ||
+			    num > JAP_DICE_MAX)
+				return detail::error();
+			return detail::pool(s, len, i, n, num);
+		default:
+			if (detail::space(ch))
+				continue;
+			if (ch < '0' || ch > '9')
+				return detail::error();
+			num = detail::number(s, len, &i, num);
+			i--;
+		}
+		firstchr = false;
+	}
+	if (num == 0 || num > JAP_DICE_MAX || !seenn)
+		return detail::error();
+	return parsed{0, type, n, num, 0};
+}
+
+namespace detail {
+
+// Internal helper function: 0 <= X < x, drawn exactly as jdice_uniform
+// would, but with x known at compile time.
+template <int x>
+inline int uniform(jdice_rng* rng) {
+	static_assert(x >= 1, "dice need at least one side");
+	constexpr uint32_t s = (uint32_t)x;
+	if (rng == nullptr)
+		return jdice_uniform(nullptr, x);
+#ifdef JAP_DICE_LEGACY_MOD
+	return (int)(jdice_next(rng) % s);
+#else
+	uint64_t r = jdice_next(rng);
+	if constexpr ((s & (s - 1)) == 0) {
+		return (int)(r & (s - 1));
+	} else {
+		uint64_t m = (r >> 32) * s;
+		if ((uint32_t)m < s) {
+			constexpr uint32_t t = -s % s;
+			while ((uint32_t)m < t)
+				m = (jdice_next(rng) >> 32) * s;
+		}
+		return (int)(m >> 32);
+	}
+#endif	/* JAP_DICE_LEGACY_MOD */
+}
+
+// Internal helper function: the sum of n X-sided dice, each plus add. Pools
+// this small are rolled a die at a time by jdice_ndx_r and jdice_fudge_r
+// too, so this gives the same results.
+template <int n, int x, int add>
+inline int sum(jdice_rng* rng) {
+	int result = 0;
+	for (int i = 0; i < n; i++)
+		result += uniform<x>(rng) + add;
+	return result;
+}
+
+}	/* namespace detail */
+
+/* Dice known at compile time, usually from the _dice literal */
+template <jap_dice_type Type, int N, int X, int T = 0>
+struct dice {
+	static constexpr jap_dice_type type = Type;
+	static constexpr int n = N;
+	static constexpr int x = X;
+	static constexpr int t = T;
+
+	/* The same dice as a jap_diceroll, for the C functions */
+	static constexpr jap_diceroll roll_struct() {
+		return jap_diceroll{Type, N, X, T};
+	}
+
+	/* Roll the dice. rng is nullable; if rng=null, JAP_RAND is used. */
+	static int roll(jdice_rng* rng = nullptr) {
+		static_assert(N >= 1 && N <= JAP_DICE_MAX,
+			      "bad number of dice");
+		/* jdice_ndx_r and jdice_fudge_r take 8 or more dice (or any
+		 * without an rng) a word at a time */
+		constexpr bool small = N < 8;
+		if constexpr (Type == DNDX) {
+			if (!small || rng == nullptr)
+				return jdice_ndx_r(rng, N, X);
+			return detail::sum<N, X, 1>(rng);
+		} else if constexpr (Type == DFUDGE) {
+			if (!small || rng == nullptr)
+				return jdice_fudge_r(rng, N);
+			return detail::sum<N, 3, -1>(rng);
+		} else if constexpr (Type == DMAX || Type == DMIN) {
+			if (N > 1 || rng == nullptr)
+				return Type == DMAX ? jdice_max_r(rng, N, X) :
+					jdice_min_r(rng, N, X);
+			return detail::uniform<X>(rng) + 1;
+		} else if constexpr (Type == DSUCC) {
+			return jdice_succ_r(rng, N, X, T);
+		} else if constexpr (Type == DEXPL) {
+			return jdice_expl_r(rng, N, X);
+		} else if constexpr (Type == DXSUCC) {
+			return jdice_xsucc_r(rng, N, X, T);
+		} else {
+			return jdice_reroll_r(rng, N, X, T);
+		}
+	}
+
+	int operator()(jdice_rng* rng = nullptr) const {
+		return roll(rng);
+	}
+};
+
+namespace literals {
+
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#ifdef __clang__
+#pragma GCC diagnostic ignored "-Wgnu-string-literal-operator-template"
+#endif	/* __clang__ */
+
+/* "3d6"_dice is jdice::dice<DNDX, 3, 6>{}; anything jdice_parse would
+ * reject doesn't compile */
+template <typename C, C... cs>
+constexpr auto operator""_dice() {
+	constexpr char s[] = {cs..., '\0'};
+	constexpr parsed p = parse(s, sizeof...(cs));
+	static_assert(p.err == 0, "not a valid dice roll");
+	return dice<p.type, p.n, p.x, p.t>{};
+}
+
+#pragma GCC diagnostic pop
+#endif	/* __GNUC__ */
+
+}	/* namespace literals */
+
+}	/* namespace jdice */
+
+#endif	/* _JAP_DICE_HPP */
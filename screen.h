@@ -15,7 +15,8 @@
  * If you want to find out what byte sequence you should use for
  * e.g. Home and End (most likely ESC-something), use the byte_echo
  * program, the source code of which should be provided with this
- * file.
+ * file. Or let wdsc_poll_event() work it out for you; byte_echo -e
+ * shows what it makes of your keys.
  *
  * ## USAGE
  *
@@ -26,16 +27,24 @@
  * Run wdsc_init() before you do anything; wdsc_end() when you're done.
  *
  * Get the terminal size with the wdsc_screensize(&x, &y)
- * function. Beware, this is a little slow, so cache those values
- * somewhere (a global is perfectly acceptable). See below for
+ * function. The library asks the terminal driver the first time and
+ * remembers the answer, so after that it's free. See below for
  * handling terminals being resized.
  *
- * To grab a byte of input, call wdsc_poll().
+ * To grab a byte of input, call wdsc_poll(). To grab a key, call
+ * wdsc_poll_event(&ev); see below.
  *
  * To move the cursor around, call wdsc_set_cursor(x, y). Note indices
  * start from 1, 1 at the top left corner of the terminal, and grow
  * larger as you go to the bottom right.
  *
+ * The library keeps track of where the cursor really is, and moves it
+ * there by the shortest sequence it can find, so drawing things close
+ * together costs a few bytes of movement, not a whole CUP. Drawing doesn't
+ * move the cursor as far as you're concerned: wdsc_present() leaves it
+ * where wdsc_set_cursor() put it or, if you've never called that, where it
+ * was before (using the terminal's saved cursor, ESC 7 and ESC 8).
+ *
  * Most terminals should allow you to hide and show the cursor with
  * wdsc_hide_cursor() and wdsc_show_cursor() respectively.
  *
@@ -50,6 +59,17 @@
  * codes you can use for attributes. Once you're done, call
  * wdsc_attr_off().
  *
+ * Attributes aren't sent straight away, but remembered until you draw
+ * something. Then the library sends one SGR sequence with whatever
+ * changed since the last thing it drew, so turning attributes on and off
+ * around every cell costs nothing if they end up the same. It knows the
+ * codes for bold, faint, italic, underline, blink, reverse, hidden and
+ * crossed out (and the ones turning them off), the 8 and 16 colors, and
+ * 38;5;n or 38;2;r;g;b (48 for background) for 256 colors and true color,
+ * also written with colons (38:2::r:g:b); 4:n underline styles count as
+ * plain underline. Anything else is ignored. wdsc_fg(c) and wdsc_bg(c) set
+ * colors too, where c is 0 to 255, WDSC_RGB(r, g, b), or WDSC_DEFAULT.
+ *
  * **PLEASE DO NOT ASSUME YOUR USER IS USING WHITE ON BLACK OR BLACK
  * ON WHITE FOR THEIR TERMINAL. "BLACK" MAY BE DIFFERENT TO THE
  * FOREGROUND, "WHITE" MAY BE DIFFERENT TO THE BACKGROUND, AND VICE
@@ -58,47 +78,165 @@
  * ISSUES.**
  *
  * Once you're done manipulating the screen, call wdsc_present() to
- * flush the buffers and present the screen.
+ * flush the buffers and present the screen. Nothing reaches the terminal
+ * before then: output collects in a frame buffer, which wdsc_present()
+ * sends with a single write() to standard output. This doesn't go through
+ * stdio, so if you print things with stdio too, fflush(stdout) before
+ * calling wdsc_present().
  *
- * ### RESIZING THE TERMINAL
+ * The frame buffer starts at WDSC_OUT_INIT bytes (define it before
+ * including the implementation to change this) and doubles as needed. To
+ * avoid the allocation, call wdsc_output_buffer(buf, size) to use your own
+ * buffer instead; when it fills up, it's written out early.
+ * wdsc_output_buffer(NULL, 0) goes back to the growing one.
  *
- * If the terminal size changes, the program will be sent the signal
- * SIGWINCH. This library delegates handling this to the user. Since
- * the default behavior is to just ignore this signal, you can safely
- * set it up to run some custom code instead.
+ * ### DOUBLE BUFFERING
  *
- * I recommend a function pointer variable (global) for the current
- * draw function, which should take size x and y, or load them from
- * your cache. Before calling this function, update your cache by
- * calling wdsc_screensize(&x, &y). Trivial example:
+ * By default, every call above sends its escape codes straight away, so
+ * redrawing the whole screen each frame sends the whole screen each
+ * frame. Call wdsc_buffer_on() after wdsc_init() to draw into a grid of
+ * cells in memory instead: wdsc_set(), wdsc_puts(), wdsc_clear() and the
+ * attribute functions then only change the grid, and wdsc_present()
+ * compares it with what's on the terminal and sends just the cells that
+ * changed. Each cell holds one byte and the attributes it was drawn
+ * with; anything that would fall off the right edge is dropped.
+ * wdsc_clear() blanks the grid in the default colors.
  *
- * ```
- * #include<signal.h>
+ * wdsc_present() also notices rows that have only moved up or down, like a
+ * log scrolling by, and moves them with the terminal's own scrolling (a
+ * scrolling region, then CSI S or CSI T) instead of sending them again,
+ * so scrolling by a line costs about a line.
+ *
+ * The grid is the size wdsc_screensize() last reported; calling it again
+ * after a resize resizes the grid, keeping what fits, and repaints
+ * everything on the next wdsc_present(). If something else has drawn on
+ * the terminal, call wdsc_redraw() to do the same. wdsc_buffer_off()
+ * goes back to sending everything straight away.
+ *
+ * ### INPUT
+ *
+ * Input is read as a whole buffer at a time (WDSC_IN_MAX bytes; 4096 by
+ * default), so a burst of keys, a mouse drag or a paste doesn't cost a
+ * system call per byte. wdsc_poll() hands it out byte by byte, as the
+ * terminal sent it.
+ *
+ * wdsc_poll_event(&ev) makes sense of it instead, and fills in a struct
+ * wdsc_event; it returns ev.type, which is WDSC_EV_KEY, WDSC_EV_MOUSE or
+ * WDSC_EV_RESIZE. For a key, ev.key is the character as a Unicode code
+ * point (input is taken to be UTF-8; bytes that aren't come out as
+ * themselves), or one of WDSC_KEY_UP, WDSC_KEY_F1 and so on for keys that
+ * aren't characters. Control keys are their control characters, e.g.
+ * Ctrl-A is 1 and Escape is 27. ev.mod has WDSC_MOD_SHIFT, WDSC_MOD_ALT,
+ * WDSC_MOD_CTRL and WDSC_MOD_META for modifiers the terminal reports;
+ * Alt and a character comes as that character with WDSC_MOD_ALT.
+ *
+ * The Escape key and the start of an escape sequence look the same, so
+ * after a lone ESC, wdsc_poll_event() waits WDSC_ESC_TIMEOUT milliseconds
+ * (25 by default) for the rest before deciding it was the key. Over a
+ * slow link, you may want longer; set it with wdsc_esc_timeout(ms).
+ * Sequences the library doesn't know are skipped.
+ *
+ * After wdsc_mouse_on(), the mouse makes WDSC_EV_MOUSE events: ev.key is
+ * WDSC_MOUSE_PRESS, WDSC_MOUSE_RELEASE or WDSC_MOUSE_MOVE (while a button
+ * is held), ev.button is WDSC_MOUSE_LEFT, WDSC_MOUSE_WHEEL_UP and so on,
+ * and ev.x and ev.y say where, from 1, 1 at the top left. After
+ * wdsc_paste_on(), pasted text comes as keys with WDSC_MOD_PASTE set, so
+ * you can tell it from typing (e.g. to not auto-indent it, or run it as
+ * commands). Both take effect at the next wdsc_present(), and go off
+ * again with wdsc_mouse_off() and wdsc_paste_off(), or wdsc_end().
+ *
+ * ### WAITING FOR OTHER THINGS
+ *
+ * wdsc_poll() and wdsc_poll_event() wait as long as it takes.
+ * wdsc_poll_timeout(ms) and wdsc_poll_event_timeout(&ev, ms) give up
+ * after ms milliseconds (0 doesn't wait at all; a negative ms waits
+ * forever), returning WDSC_TIMEOUT or WDSC_EV_TIMEOUT.
  *
- * int sx;
- * int sy;
- * void (*draw)();
+ * wdsc_poll_event() (with or without a timeout) can wait for other things
+ * at the same time, so one thread can run the whole program:
  *
- * void my_draw_func() {
+ * - wdsc_watch_fd(fd, POLLIN) (or any other poll() events) watches fd;
+ *   when poll() says something about it, you get a WDSC_EV_FD event with
+ *   ev.id the fd and ev.revents what poll() said. wdsc_unwatch_fd(fd)
+ *   stops that. It takes up to WDSC_MAX_FDS fds (16 by default).
+ * - wdsc_add_timer(ms, repeat) returns a timer id (or -1 if there are
+ *   already WDSC_MAX_TIMERS, 16 by default); after ms milliseconds you
+ *   get a WDSC_EV_TIMER event with ev.id the id, and again every ms
+ *   milliseconds if repeat is true, until wdsc_remove_timer(id). A timer
+ *   that falls behind skips the times it missed, so it keeps a steady
+ *   rate rather than firing in bursts.
+ *
+ * A dashboard redrawing 10 times a second, and whenever its socket has
+ * news, looks like:
+ *
+ * ```
+ * wdsc_add_timer(100, 1);
+ * wdsc_watch_fd(sock, POLLIN);
+ * for (;;) {
+ *     struct wdsc_event ev;
+ *     switch (wdsc_poll_event(&ev)) {
+ *     case WDSC_EV_FD:
+ *         read_news(sock);
+ *         break;
+ *     case WDSC_EV_TIMER:
+ *     case WDSC_EV_RESIZE:
+ *         draw();
+ *         wdsc_present();
+ *         break;
  *     ...
+ *     }
  * }
+ * ```
  *
- * void sigwinch(int signal) {
- *     wdsc_screensize(&sx, &sy);
- *     draw()
- * }
+ * If you have an event loop of your own, watch wdsc_fd() (the terminal's
+ * input) and wdsc_resize_fd() (readable when the terminal's been resized)
+ * in it, and when either is readable, call wdsc_poll_event_timeout(&ev, 0)
+ * until it returns WDSC_EV_TIMEOUT; input is read a buffer at a time, so
+ * there may be more than one event waiting.
  *
+ * ### RESIZING THE TERMINAL
+ *
+ * If the terminal size changes, the program will be sent the signal
+ * SIGWINCH. wdsc_init() sets up a handler for it, which does nothing but
+ * wake up wdsc_poll(): instead of a byte, that returns WDSC_RESIZE (and
+ * wdsc_poll_event() returns WDSC_EV_RESIZE), and by then
+ * wdsc_screensize() has the new size (and the grid, if you're using one,
+ * has been resized). So redraw when you see it:
+ *
+ * ```
  * int main() {
+ *     int sx, sy;
  *     wdsc_init();
  *     wdsc_screensize(&sx, &sy);
- *     draw = my_draw_func;
- *     signal(SIGWINCH, sigwinch);
- *     ...
+ *     draw(sx, sy);
+ *     for (;;) {
+ *         int c = wdsc_poll();
+ *         if (c == WDSC_RESIZE) {
+ *             wdsc_screensize(&sx, &sy);
+ *             draw(sx, sy);
+ *         } else if (c == 'q') {
+ *             break;
+ *         }
+ *         ...
+ *     }
  *     wdsc_end();
  *     return 0;
  * }
  * ```
  *
+ * Don't draw from a signal handler; almost nothing is safe to call there.
+ * wdsc_end() puts back whatever handler SIGWINCH had before.
+ *
+ * The size comes from the TIOCGWINSZ ioctl. If that doesn't work (say,
+ * over a serial line), the library moves the cursor as far down and right
+ * as it goes and asks the terminal where it ended up, waiting up to
+ * WDSC_DSR_TIMEOUT milliseconds (500 by default) for an answer; failing
+ * that, it assumes 80x24.
+ *
+ * The implementation needs POSIX (signals, poll(), ioctl()); if you
+ * compile with e.g. -std=c99 rather than the default, define
+ * _POSIX_C_SOURCE as 200809L or later first.
+ *
  * ## COPYING
  *
  * MIT LICENSE:
@@ -126,6 +264,8 @@
  * SOFTWARE.
  */
 
+#include <stddef.h>
+
 void wdsc_init();
 
 void wdsc_end();
@@ -146,7 +286,14 @@ void wdsc_attr_on_s(char * s);
 
 void wdsc_attr_off();
 
-char wdsc_poll();
+/* What wdsc_poll() returns when the terminal's been resized, and what
+ * wdsc_poll_timeout() returns if nothing happens in time */
+#define WDSC_RESIZE -1
+#define WDSC_TIMEOUT -2
+
+int wdsc_poll();
+
+int wdsc_poll_timeout(int ms);
 
 void wdsc_screensize(int *x, int *y);
 
@@ -154,11 +301,128 @@ void wdsc_hide_cursor();
 
 void wdsc_show_cursor();
 
+void wdsc_buffer_on();
+
+void wdsc_buffer_off();
+
+void wdsc_redraw();
+
+void wdsc_output_buffer(char *buf, size_t size);
+
+/* Colors for wdsc_fg() and wdsc_bg(): 0 to 255 are the terminal's palette,
+ * WDSC_RGB(r, g, b) is a true color, and WDSC_DEFAULT is the default */
+#define WDSC_DEFAULT -1
+#define WDSC_RGB(r, g, b) (0x1000000 | (r) << 16 | (g) << 8 | (b))
+
+void wdsc_fg(int color);
+
+void wdsc_bg(int color);
+
+/* Kinds of wdsc_event */
+enum wdsc_event_type {
+	WDSC_EV_KEY = 1,
+	WDSC_EV_MOUSE,
+	WDSC_EV_RESIZE,
+	WDSC_EV_FD,
+	WDSC_EV_TIMER,
+	WDSC_EV_TIMEOUT,
+};
+
+/* Keys that aren't characters, numbered after the last Unicode one */
+enum wdsc_key {
+	WDSC_KEY_UP = 0x110000,
+	WDSC_KEY_DOWN,
+	WDSC_KEY_RIGHT,
+	WDSC_KEY_LEFT,
+	WDSC_KEY_HOME,
+	WDSC_KEY_END,
+	WDSC_KEY_INSERT,
+	WDSC_KEY_DELETE,
+	WDSC_KEY_PGUP,
+	WDSC_KEY_PGDN,
+	WDSC_KEY_BACKTAB,
+	WDSC_KEY_F1,
+	WDSC_KEY_F2,
+	WDSC_KEY_F3,
+	WDSC_KEY_F4,
+	WDSC_KEY_F5,
+	WDSC_KEY_F6,
+	WDSC_KEY_F7,
+	WDSC_KEY_F8,
+	WDSC_KEY_F9,
+	WDSC_KEY_F10,
+	WDSC_KEY_F11,
+	WDSC_KEY_F12,
+	/* What a mouse event's key is */
+	WDSC_MOUSE_PRESS,
+	WDSC_MOUSE_RELEASE,
+	WDSC_MOUSE_MOVE,
+};
+
+/* Mouse buttons; 8 and up are the extra buttons some mice have */
+#define WDSC_MOUSE_LEFT 0
+#define WDSC_MOUSE_MIDDLE 1
+#define WDSC_MOUSE_RIGHT 2
+#define WDSC_MOUSE_NONE 3
+#define WDSC_MOUSE_WHEEL_UP 4
+#define WDSC_MOUSE_WHEEL_DOWN 5
+
+/* Modifier bits */
+#define WDSC_MOD_SHIFT 1
+#define WDSC_MOD_ALT 2
+#define WDSC_MOD_CTRL 4
+#define WDSC_MOD_META 8
+#define WDSC_MOD_PASTE 16
+
+struct wdsc_event {
+	int type;	/* WDSC_EV_* */
+	int key;	/* Unicode code point, WDSC_KEY_* or WDSC_MOUSE_* */
+	int mod;	/* WDSC_MOD_* bits */
+	int button;	/* The mouse button */
+	int x;		/* Where the mouse is */
+	int y;
+	int id;		/* The fd, or the timer */
+	int revents;	/* What poll() said about the fd */
+};
+
+int wdsc_poll_event(struct wdsc_event *ev);
+
+int wdsc_poll_event_timeout(struct wdsc_event *ev, int ms);
+
+int wdsc_fd();
+
+int wdsc_resize_fd();
+
+int wdsc_watch_fd(int fd, int events);
+
+void wdsc_unwatch_fd(int fd);
+
+int wdsc_add_timer(int ms, int repeat);
+
+void wdsc_remove_timer(int id);
+
+void wdsc_esc_timeout(int ms);
+
+void wdsc_mouse_on();
+
+void wdsc_mouse_off();
+
+void wdsc_paste_on();
+
+void wdsc_paste_off();
+
 #ifdef WDSC_IMPLEMENTATION
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include "screen.h"
 
@@ -170,8 +434,8 @@ static void die(const char *s) {
 
 /* Some macro fun for shortcuts; I'm too lazy to write out shit in full. */
 
-/* Quick putc (avoid typing out stdout) */
-#define QPUTC(c) fputc(c, stdout)
+/* Quick putc (into the frame buffer) */
+#define QPUTC(c) out_putc(c)
 
 /* Print ESC */
 #define ESC QPUTC(033)
@@ -182,14 +446,208 @@ static void die(const char *s) {
 /* Call CUP quickly with two chars */
 #define CUPRICE(x, y) CSI; QPUTC(y); QPUTC(;) QPUTC(x); QPUTC('H')
 
-/* Flush stdout */
-#define DOFLUSH fflush(stdout)
+/* Send the frame buffer to the terminal */
+#define DOFLUSH out_flush()
 
 /* Print an m (tail of SGR) */
 #define SGR_TAIL QPUTC('m');
 
+/* How big the frame buffer starts; it doubles whenever it fills up */
+#ifndef WDSC_OUT_INIT
+#define WDSC_OUT_INIT 4096
+#endif
+
+/* The frame buffer: everything we send waits here until DOFLUSH */
+static char *out = NULL;
+static size_t out_len = 0;
+static size_t out_cap = 0;
+static bool out_owned = true;
+
+/* Write the frame buffer to the terminal in one go, if it'll take it */
+static void out_flush() {
+	size_t done = 0;
+	while (done < out_len) {
+		ssize_t n = write(STDOUT_FILENO, out + done, out_len - done);
+		if (n > 0) {
+			done += n;
+		} else if (n < 0 && errno == EAGAIN) {
+			struct pollfd pfd = {STDOUT_FILENO, POLLOUT, 0};
+			poll(&pfd, 1, -1);
+		} else if (n == 0 || errno != EINTR) {
+			/* The terminal's gone; nothing we can do about it */
+			break;
+		}
+	}
+	out_len = 0;
+}
+
+/* Make room for at least one more byte */
+static void out_room() {
+	if (out_len < out_cap)
+		return;
+	if (!out_owned) {
+		out_flush();
+		return;
+	}
+	size_t cap = out_cap ? out_cap * 2 : WDSC_OUT_INIT;
+	char *nout = (char *)realloc(out, cap);
+	if (!nout)
+		die("realloc");
+	out = nout;
+	out_cap = cap;
+}
+
+static void out_putc(char c) {
+	out_room();
+	out[out_len++] = c;
+}
+
+static void out_puts(const char *s) {
+	while (*s) {
+		out_room();
+		while (*s && out_len < out_cap)
+			out[out_len++] = *s++;
+	}
+}
+
+/* Write n in decimal to s, which has room for 12 bytes; returns the length */
+static int fmt_int(char *s, int n) {
+	char tmp[12];
+	int len = 0;
+	unsigned u = n < 0 ? 0u - (unsigned)n : (unsigned)n;
+	do {
+		tmp[len++] = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	int i = 0;
+	if (n < 0)
+		s[i++] = '-';
+	while (len)
+		s[i++] = tmp[--len];
+	s[i] = 0;
+	return i;
+}
+
+static void out_int(int n) {
+	char s[12];
+	fmt_int(s, n);
+	out_puts(s);
+}
+
+/* How long to wait for the terminal to say how big it is, in ms */
+#ifndef WDSC_DSR_TIMEOUT
+#define WDSC_DSR_TIMEOUT 500
+#endif
+
+/* How much input we read at once */
+#ifndef WDSC_IN_MAX
+#define WDSC_IN_MAX 4096
+#endif
+
+/* How long to wait for the rest of an escape sequence, in ms */
+#ifndef WDSC_ESC_TIMEOUT
+#define WDSC_ESC_TIMEOUT 25
+#endif
+
+/* How many fds and timers wdsc_poll_event() can watch besides the
+ * terminal */
+#ifndef WDSC_MAX_FDS
+#define WDSC_MAX_FDS 16
+#endif
+#ifndef WDSC_MAX_TIMERS
+#define WDSC_MAX_TIMERS 16
+#endif
+
+/* Most SGR parameters wdsc_attr_on_s() will look at */
+#ifndef WDSC_SGR_MAX
+#define WDSC_SGR_MAX 32
+#endif
+
 static struct termios orig_termios;
 
+/* How things are drawn: bit n of attrs is SGR n, from 1 (bold) to 9
+ * (crossed out); fg and bg are colors as for wdsc_fg() */
+struct wdsc_pen {
+	unsigned short attrs;
+	int fg;
+	int bg;
+};
+
+static const struct wdsc_pen default_pen = {0, WDSC_DEFAULT, WDSC_DEFAULT};
+
+/* A cell of the grid; c is 0 if we don't know what's on the terminal */
+struct wdsc_cell {
+	char c;
+	struct wdsc_pen pen;
+};
+
+/* The grid: back is what's being drawn, front what the terminal shows */
+static bool buffered = false;
+static int grid_w = 0;
+static int grid_h = 0;
+static struct wdsc_cell *back = NULL;
+static struct wdsc_cell *front = NULL;
+
+/* A hash of each row of back, then of front, for spotting rows that moved */
+static unsigned *row_hash = NULL;
+
+/* The pen for the next thing drawn */
+static struct wdsc_pen pen = {0, WDSC_DEFAULT, WDSC_DEFAULT};
+
+/* The pen the terminal's drawing with, if drawn_known; and the same when we
+ * saved the cursor, since ESC 7 saves it as well */
+static struct wdsc_pen drawn;
+static bool drawn_known = false;
+static struct wdsc_pen saved_pen;
+static bool saved_known = false;
+
+/* Where wdsc_set_cursor() last put the cursor; 0 if it hasn't */
+static int want_x = 0;
+static int want_y = 0;
+
+/* Where the cursor really is; 0 if we don't know */
+static int cur_x = 0;
+static int cur_y = 0;
+
+/* Whether we've saved the cursor (ESC 7) to put it back at the present */
+static bool saved = false;
+
+/* The terminal size, as last found; 0 until wdsc_screensize() asks */
+static int scr_w = 0;
+static int scr_h = 0;
+
+/* Input read but not yet taken, from in_buf[in_pos] to in_buf[in_len] */
+static unsigned char in_buf[WDSC_IN_MAX];
+static int in_len = 0;
+static int in_pos = 0;
+static int esc_timeout = WDSC_ESC_TIMEOUT;
+
+/* Whether the input's run out for good */
+static bool in_eof = false;
+
+/* Other fds to watch, and the one to check first next time, so a busy one
+ * doesn't starve the rest */
+static struct pollfd watched[WDSC_MAX_FDS];
+static int nwatched = 0;
+static int watch_turn = 0;
+
+/* Timers: when they're next due (on the monotonic clock, in ms), and how
+ * often they repeat, or 0 if they don't; due is 0 if the timer's free */
+struct wdsc_timer {
+	long long due;
+	int interval;
+};
+static struct wdsc_timer timers[WDSC_MAX_TIMERS];
+
+/* Whether we're in the middle of a bracketed paste, and which modes are on */
+static bool pasting = false;
+static bool mouse = false;
+static bool paste = false;
+
+/* The self-pipe: on SIGWINCH, a byte goes in [1] to wake up wdsc_poll() */
+static int resize_pipe[2] = {-1, -1};
+static struct sigaction old_sigwinch;
+
 /* Thanks, antirez's kilo. */
 static void enableRawMode() {
 	struct termios raw;
@@ -206,143 +664,1335 @@ static void disableRawMode() {
 		die("tcsetattr");
 }
 
-void wdsc_end() {
-	disableRawMode();
+static void csi_cup(int x, int y) {
+	CSI;
+	out_int(y);
+	QPUTC(';');
+	out_int(x);
+	QPUTC('H');
 }
 
-static void csi_cup(int x, int y) {
+/* Number of digits in n > 0 */
+static int digits(int n) {
+	int d = 1;
+	while (n >= 10) {
+		n /= 10;
+		d++;
+	}
+	return d;
+}
+
+/* Bytes in CSI n c, where n is left out if it's 1 */
+static int csi_n_len(int n) {
+	return n == 1 ? 3 : 3 + digits(n);
+}
+
+/* Print CSI n c, leaving out n if it's 1 */
+static void csi_n(int n, char c) {
+	CSI;
+	if (n != 1)
+		out_int(n);
+	QPUTC(c);
+}
+
+/* Save the cursor (and the pen) to put back later */
+static void save_cursor() {
+	ESC;
+	QPUTC('7');
+	saved = true;
+	saved_pen = drawn;
+	saved_known = drawn_known;
+}
+
+/* Put back what save_cursor() saved */
+static void restore_cursor() {
+	ESC;
+	QPUTC('8');
+	saved = false;
+	cur_x = 0;
+	cur_y = 0;
+	drawn = saved_pen;
+	drawn_known = saved_known;
+}
+
+static bool pen_eq(const struct wdsc_pen *a, const struct wdsc_pen *b) {
+	return a->attrs == b->attrs && a->fg == b->fg && a->bg == b->bg;
+}
+
+/* Apply the SGR parameters p[0] to p[n - 1] to the pen */
+static void pen_apply(const int *p, int n) {
+	for (int i = 0; i < n; i++) {
+		int c = p[i];
+		if (c == 0) {
+			pen = default_pen;
+		} else if (c >= 1 && c <= 9 && c != 6) {
+			pen.attrs |= 1 << c;
+		} else if (c == 22) {
+			pen.attrs &= ~(1 << 1 | 1 << 2);
+		} else if (c >= 23 && c <= 29 && c != 26) {
+			pen.attrs &= ~(1 << (c - 20));
+		} else if (c >= 30 && c <= 37) {
+			pen.fg = c - 30;
+		} else if (c >= 40 && c <= 47) {
+			pen.bg = c - 40;
+		} else if (c >= 90 && c <= 97) {
+			pen.fg = c - 90 + 8;
+		} else if (c >= 100 && c <= 107) {
+			pen.bg = c - 100 + 8;
+		} else if (c == 39) {
+			pen.fg = WDSC_DEFAULT;
+		} else if (c == 49) {
+			pen.bg = WDSC_DEFAULT;
+		} else if (c == 38 || c == 48) {
+			int *color = c == 38 ? &pen.fg : &pen.bg;
+			if (i + 2 < n && p[i + 1] == 5) {
+				*color = p[i + 2] & 255;
+				i += 2;
+			} else if (i + 4 < n && p[i + 1] == 2) {
+				int r = p[i + 2] & 255;
+				int g = p[i + 3] & 255;
+				*color = WDSC_RGB(r, g, p[i + 4] & 255);
+				i += 4;
+			}
+		}
+	}
+}
+
+/* Add the parameter with the k sub-parameters in sub (just the one if there
+ * weren't any colons) to p[0] to p[n - 1], as the plain parameters meaning
+ * the same, and return the new n. 4:n (underline styles) is underline or
+ * not, 38:5:n and 38:2:[id]:r:g:b (or 48) are colors; other parameters with
+ * sub-parameters are dropped whole. */
+static int sgr_sub(int *p, int n, const int *sub, int k) {
+	int q[5];
+	int m = 0;
+	if (k == 1) {
+		q[m++] = sub[0];
+	} else if (sub[0] == 4) {
+		q[m++] = sub[1] ? 4 : 24;
+	} else if ((sub[0] == 38 || sub[0] == 48) && sub[1] == 5) {
+		q[m++] = sub[0];
+		q[m++] = 5;
+		q[m++] = sub[2];
+	} else if ((sub[0] == 38 || sub[0] == 48) && sub[1] == 2 && k >= 5) {
+		/* The color space id is optional, so count from the end */
+		int rgb = k >= 6 ? 3 : 2;
+		q[m++] = sub[0];
+		q[m++] = 2;
+		q[m++] = sub[rgb];
+		q[m++] = sub[rgb + 1];
+		q[m++] = sub[rgb + 2];
+	}
+	if (n + m > WDSC_SGR_MAX)
+		return n;
+	for (int i = 0; i < m; i++)
+		p[n++] = q[i];
+	return n;
+}
+
+/* Add SGR parameter n to the s[*len], which needs room for 12 more bytes */
+static void sgr_add(char *s, int *len, int n) {
+	if (*len)
+		s[(*len)++] = ';';
+	*len += fmt_int(s + *len, n);
+}
+
+/* Add the parameters for color c; base is 30 for foreground, 40 for
+ * background */
+static void sgr_color(char *s, int *len, int c, int base) {
+	if (c < 0) {
+		sgr_add(s, len, base + 9);
+	} else if (c < 8) {
+		sgr_add(s, len, base + c);
+	} else if (c < 16) {
+		sgr_add(s, len, base + 60 + c - 8);
+	} else {
+		sgr_add(s, len, base + 8);
+		if (c < 256) {
+			sgr_add(s, len, 5);
+			sgr_add(s, len, c);
+		} else {
+			sgr_add(s, len, 2);
+			sgr_add(s, len, c >> 16 & 255);
+			sgr_add(s, len, c >> 8 & 255);
+			sgr_add(s, len, c & 255);
+		}
+	}
+}
+
+/*
+ * Switch the terminal to pen to, with one SGR: either the changes from what
+ * it's drawing with now, or a reset followed by everything to has on,
+ * whichever is shorter.
+ */
+static void sgr_to(const struct wdsc_pen *to) {
+	if (drawn_known && pen_eq(&drawn, to))
+		return;
+
+	/* From scratch; a lone 0 can be left out */
+	char full[80];
+	int flen = 0;
+	sgr_add(full, &flen, 0);
+	for (int a = 1; a <= 9; a++)
+		if (to->attrs & 1 << a)
+			sgr_add(full, &flen, a);
+	if (to->fg != WDSC_DEFAULT)
+		sgr_color(full, &flen, to->fg, 30);
+	if (to->bg != WDSC_DEFAULT)
+		sgr_color(full, &flen, to->bg, 40);
+	if (flen == 1)
+		flen = 0;
+	full[flen] = 0;
+
+	/* The changes; 22 turns off bold and faint both */
+	char diff[80];
+	int dlen = 0;
+	if (drawn_known) {
+		unsigned off = drawn.attrs & ~to->attrs;
+		unsigned on = to->attrs & ~drawn.attrs;
+		if (off & (1 << 1 | 1 << 2)) {
+			sgr_add(diff, &dlen, 22);
+			on |= to->attrs & (1 << 1 | 1 << 2);
+		}
+		for (int a = 3; a <= 9; a++)
+			if (off & 1 << a)
+				sgr_add(diff, &dlen, 20 + a);
+		for (int a = 1; a <= 9; a++)
+			if (on & 1 << a)
+				sgr_add(diff, &dlen, a);
+		if (to->fg != drawn.fg)
+			sgr_color(diff, &dlen, to->fg, 30);
+		if (to->bg != drawn.bg)
+			sgr_color(diff, &dlen, to->bg, 40);
+		diff[dlen] = 0;
+	}
+
 	CSI;
-	fprintf(stdout, "%i;%iH", y, x);
+	out_puts(drawn_known && dlen < flen ? diff : full);
+	SGR_TAIL;
+	drawn = *to;
+	drawn_known = true;
+}
+
+/*
+ * Move the cursor to x, y in as few bytes as we can, or if emit is false,
+ * just work out how many bytes that would be. This is the cheapest of a
+ * move to the row (a line feed or two, CUU/CUD or VPA) and a move to the
+ * column (CR, a backspace or two, CUF/CUB or CHA), or a plain CUP.
+ */
+static int move(int x, int y, bool emit) {
+	if (x == cur_x && y == cur_y)
+		return 0;
+
+	/* To the row: c is the final byte, or the byte to repeat n times */
+	int vcost = 0;
+	char vc = 0;
+	int vn = y;
+	if (y != cur_y) {
+		vcost = csi_n_len(y);
+		vc = 'd';
+		if (cur_y) {
+			int dy = y - cur_y;
+			int n = dy < 0 ? -dy : dy;
+			if (csi_n_len(n) < vcost) {
+				vcost = csi_n_len(n);
+				vc = dy < 0 ? 'A' : 'B';
+				vn = n;
+			}
+			if (dy > 0 && dy < vcost) {
+				vcost = dy;
+				vc = '\n';
+			}
+		}
+	}
+
+	/* To the column, likewise */
+	int hcost = 0;
+	char hc = 0;
+	int hn = x;
+	if (x != cur_x) {
+		hcost = csi_n_len(x);
+		hc = 'G';
+		if (x == 1) {
+			hcost = 1;
+			hc = '\r';
+		} else if (cur_x) {
+			int dx = x - cur_x;
+			int n = dx < 0 ? -dx : dx;
+			if (csi_n_len(n) < hcost) {
+				hcost = csi_n_len(n);
+				hc = dx < 0 ? 'D' : 'C';
+				hn = n;
+			}
+			if (dx < 0 && n < hcost) {
+				hcost = n;
+				hc = '\b';
+			}
+		}
+	}
+
+	/* CSI y;x H, where either number is left out if it's 1 */
+	int cup = 3 + (y == 1 ? 0 : digits(y)) + (x == 1 ? 0 : 1 + digits(x));
+	if (!emit)
+		return cup < vcost + hcost ? cup : vcost + hcost;
+
+	/* Save the cursor if we'll need to put it back */
+	if (!want_x && !saved)
+		save_cursor();
+
+	if (cup <= vcost + hcost) {
+		CSI;
+		if (y != 1)
+			out_int(y);
+		if (x != 1) {
+			QPUTC(';');
+			out_int(x);
+		}
+		QPUTC('H');
+	} else {
+		if (vc == '\n')
+			for (int i = 0; i < y - cur_y; i++)
+				QPUTC('\n');
+		else if (vc)
+			csi_n(vn, vc);
+		if (hc == '\r')
+			QPUTC('\r');
+		else if (hc == '\b')
+			for (int i = 0; i < cur_x - x; i++)
+				QPUTC('\b');
+		else if (hc)
+			csi_n(hn, hc);
+	}
+	cur_x = x;
+	cur_y = y;
+	return 0;
+}
+
+static void move_to(int x, int y) {
+	move(x, y, true);
+}
+
+/* Note the cursor moved over n bytes of text from column x; plain is true if
+ * the text is all printable ASCII, so each byte takes a column */
+static void moved_over(int x, int n, bool plain) {
+	if (!plain || !scr_w || x + n > scr_w + 1) {
+		/* Anywhere, maybe on another row */
+		cur_x = 0;
+		cur_y = 0;
+	} else if (x + n == scr_w + 1) {
+		/* Waiting to wrap at the right edge, which moves differ on */
+		cur_x = 0;
+	} else {
+		cur_x = x + n;
+	}
+}
+
+/* Whether c takes up exactly one column */
+static bool plain_char(char c) {
+	return c >= ' ' && c < 0x7f;
+}
+
+/* All a signal handler can safely do: write to the pipe. If it's full,
+ * there's a resize waiting anyway */
+static void on_sigwinch(int sig) {
+	int saved_errno = errno;
+	char c = (char)sig;
+	ssize_t n = write(resize_pipe[1], &c, 1);
+	(void)n;
+	errno = saved_errno;
+}
+
+static void open_resize_pipe() {
+	if (resize_pipe[0] >= 0)
+		return;
+	if (pipe(resize_pipe) == -1)
+		die("pipe");
+	for (int i = 0; i < 2; i++) {
+		fcntl(resize_pipe[i], F_SETFL,
+		      fcntl(resize_pipe[i], F_GETFL) | O_NONBLOCK);
+		fcntl(resize_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_sigwinch;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGWINCH, &sa, &old_sigwinch);
+}
+
+static void close_resize_pipe() {
+	if (resize_pipe[0] < 0)
+		return;
+	sigaction(SIGWINCH, &old_sigwinch, NULL);
+	close(resize_pipe[0]);
+	close(resize_pipe[1]);
+	resize_pipe[0] = -1;
+	resize_pipe[1] = -1;
 }
 
 void wdsc_init() {
 	if (tcgetattr(STDIN_FILENO, &orig_termios) == -1)
 		die("tcsetattr");
 	enableRawMode();
+	open_resize_pipe();
 	DOFLUSH;
 	atexit(disableRawMode);
 }
 
+/* Fill n cells with blanks in the default colors */
+static void blank_cells(struct wdsc_cell *cells, int n) {
+	for (int i = 0; i < n; i++) {
+		cells[i].c = ' ';
+		cells[i].pen = default_pen;
+	}
+}
+
+/* Whether the terminal needs to be told about cell i */
+static bool cell_changed(int i) {
+	return back[i].c != front[i].c || !pen_eq(&back[i].pen, &front[i].pen);
+}
+
+/* Hash of the n cells at cells */
+static unsigned hash_cells(const struct wdsc_cell *cells, int n) {
+	unsigned h = 2166136261u;
+	for (int i = 0; i < n; i++) {
+		h = (h ^ (unsigned char)cells[i].c) * 16777619u;
+		h = (h ^ cells[i].pen.attrs) * 16777619u;
+		h = (h ^ (unsigned)cells[i].pen.fg) * 16777619u;
+		h = (h ^ (unsigned)cells[i].pen.bg) * 16777619u;
+	}
+	return h;
+}
+
+/* Number of cells in row y of back that differ from row fy of front, or
+ * from blanks if fy is -1 */
+static int row_diff(int y, int fy) {
+	const struct wdsc_cell *b = back + y * grid_w;
+	const struct wdsc_cell *f = front + fy * grid_w;
+	int n = 0;
+	for (int x = 0; x < grid_w; x++) {
+		if (fy < 0)
+			n += b[x].c != ' ' || !pen_eq(&b[x].pen, &default_pen);
+		else
+			n += b[x].c != f[x].c || !pen_eq(&b[x].pen, &f[x].pen);
+	}
+	return n;
+}
+
+/* Scroll rows top to bot of the terminal, and of front to match, up by n
+ * rows, or down by -n */
+static void scroll_rows(int top, int bot, int n) {
+	int m = n > 0 ? n : -n;
+	int keep = bot - top + 1 - m;
+	bool region = top > 0 || bot < grid_h - 1;
+
+	/* Setting the region moves the cursor, and the new lines come in
+	 * with the background color */
+	if (region && !want_x && !saved)
+		save_cursor();
+	sgr_to(&default_pen);
+	if (region) {
+		CSI;
+		out_int(top + 1);
+		QPUTC(';');
+		out_int(bot + 1);
+		QPUTC('r');
+	}
+	csi_n(m, n > 0 ? 'S' : 'T');
+	if (region) {
+		CSI;
+		QPUTC('r');
+		cur_x = 1;
+		cur_y = 1;
+	}
+
+	unsigned *fh = row_hash + grid_h;
+	int from = n > 0 ? top + m : top;
+	int to = n > 0 ? top : top + m;
+	int gone = n > 0 ? top + keep : top;
+	memmove(front + to * grid_w, front + from * grid_w,
+		sizeof(struct wdsc_cell) * keep * grid_w);
+	memmove(fh + to, fh + from, sizeof(unsigned) * keep);
+	blank_cells(front + gone * grid_w, m * grid_w);
+	unsigned h = hash_cells(front + gone * grid_w, grid_w);
+	for (int y = gone; y < gone + m; y++)
+		fh[y] = h;
+}
+
+/* Look for rows of back that are on the terminal already, a few rows up or
+ * down, and scroll them into place rather than draw them again */
+static void scroll_grid() {
+	unsigned *bh = row_hash;
+	unsigned *fh = row_hash + grid_h;
+	for (int y = 0; y < grid_h; y++) {
+		bh[y] = hash_cells(back + y * grid_w, grid_w);
+		fh[y] = hash_cells(front + y * grid_w, grid_w);
+	}
+
+	for (;;) {
+		/* The longest run of rows that all look to have moved by the
+		 * same d, counting the rows it would fix */
+		int best = 0;
+		int best_y = 0;
+		int best_len = 0;
+		int best_d = 0;
+		for (int d = 1 - grid_h; d < grid_h; d++) {
+			int y = d < 0 ? -d : 0;
+			int end = d > 0 ? grid_h - d : grid_h;
+			while (y < end) {
+				int start = y;
+				int fixed = 0;
+				for (; y < end && bh[y] == fh[y + d]; y++)
+					fixed += bh[y] != fh[y];
+				if (fixed > best) {
+					best = fixed;
+					best_y = start;
+					best_len = y - start;
+					best_d = d;
+				}
+				if (y == start)
+					y++;
+			}
+		}
+		if (!best)
+			return;
+
+		/* The scroll brings in |d| blank rows past the run; see if
+		 * it's really worth the escape codes, with the cells (not just
+		 * the hashes) */
+		int m = best_d > 0 ? best_d : -best_d;
+		int top = best_d > 0 ? best_y : best_y - m;
+		int bot = top + best_len + m - 1;
+		int gain = 0;
+		for (int y = best_y; y < best_y + best_len; y++)
+			gain += row_diff(y, y) - row_diff(y, y + best_d);
+		int blank = best_d > 0 ? best_y + best_len : top;
+		for (int y = blank; y < blank + m; y++)
+			gain += row_diff(y, y) - row_diff(y, -1);
+		int cost = csi_n_len(m);
+		if (top > 0 || bot < grid_h - 1)
+			cost += 8 + digits(top + 1) + digits(bot + 1);
+		if (gain <= cost)
+			return;
+
+		scroll_rows(top, bot, best_d);
+	}
+}
+
+/* Make the grid w by h, keeping what fits of the back buffer */
+static void resize_grid(int w, int h) {
+	if (w < 1 || h < 1)
+		w = h = 0;
+	struct wdsc_cell *nback = NULL;
+	struct wdsc_cell *nfront = NULL;
+	if (w > 0) {
+		size_t size = sizeof(struct wdsc_cell) * w * h;
+		nback = (struct wdsc_cell *)malloc(size);
+		nfront = (struct wdsc_cell *)malloc(size);
+		if (!nback || !nfront)
+			die("malloc");
+		blank_cells(nback, w * h);
+		int cw = w < grid_w ? w : grid_w;
+		int ch = h < grid_h ? h : grid_h;
+		for (int y = 0; y < ch; y++)
+			memcpy(nback + y * w, back + y * grid_w,
+			       sizeof(struct wdsc_cell) * cw);
+	}
+	free(back);
+	free(front);
+	free(row_hash);
+	back = nback;
+	front = nfront;
+	row_hash = NULL;
+	if (w > 0) {
+		row_hash = (unsigned *)malloc(sizeof(unsigned) * 2 * h);
+		if (!row_hash)
+			die("malloc");
+	}
+	grid_w = w;
+	grid_h = h;
+	wdsc_redraw();
+}
+
+/* Send the cells that changed since the last present */
+static void present_grid() {
+	if (!back)
+		return;
+
+	/* If we don't know what's on the screen, start from a blank one */
+	if (front[0].c == 0) {
+		sgr_to(&default_pen);
+		CSI;
+		QPUTC('2');
+		QPUTC('J');
+		blank_cells(front, grid_w * grid_h);
+	} else {
+		scroll_grid();
+	}
+
+	for (int y = 0; y < grid_h; y++) {
+		for (int x = 0; x < grid_w; x++) {
+			int i = y * grid_w + x;
+			if (!cell_changed(i))
+				continue;
+
+			/* If we're a few cells to the left on this row, and
+			 * they look the same, it's cheaper to draw them
+			 * again */
+			int gap = x + 1 - cur_x;
+			if (cur_y == y + 1 && cur_x && gap > 0 &&
+			    drawn_known && gap < move(x + 1, y + 1, false)) {
+				int j = i - gap;
+				while (j < i && pen_eq(&front[j].pen, &drawn) &&
+				       plain_char(front[j].c))
+					j++;
+				if (j == i) {
+					for (j = i - gap; j < i; j++)
+						QPUTC(front[j].c);
+					cur_x = x + 1;
+				}
+			}
+
+			move_to(x + 1, y + 1);
+			sgr_to(&back[i].pen);
+			QPUTC(back[i].c);
+			front[i] = back[i];
+			moved_over(x + 1, 1, plain_char(back[i].c));
+		}
+	}
+}
+
+void wdsc_buffer_on() {
+	int x, y;
+	buffered = true;
+	wdsc_screensize(&x, &y);
+	if (x != grid_w || y != grid_h)
+		resize_grid(x, y);
+}
+
+void wdsc_buffer_off() {
+	buffered = false;
+	resize_grid(0, 0);
+}
+
+void wdsc_output_buffer(char *buf, size_t size) {
+	DOFLUSH;
+	if (out_owned)
+		free(out);
+	if (buf && size) {
+		out = buf;
+		out_cap = size;
+		out_owned = false;
+	} else {
+		out = NULL;
+		out_cap = 0;
+		out_owned = true;
+	}
+}
+
+void wdsc_redraw() {
+	if (front)
+		front[0].c = 0;
+}
+
 void wdsc_present() {
+	if (buffered)
+		present_grid();
+
+	/* Put the cursor back */
+	if (want_x) {
+		move_to(want_x, want_y);
+		saved = false;
+	} else if (saved) {
+		restore_cursor();
+	}
+
+	/* Leave the terminal drawing normally, for whoever's next */
+	if (drawn_known)
+		sgr_to(&default_pen);
 	DOFLUSH;
 }
 
+void wdsc_end() {
+	wdsc_buffer_off();
+	if (mouse)
+		wdsc_mouse_off();
+	if (paste)
+		wdsc_paste_off();
+	if (drawn_known)
+		sgr_to(&default_pen);
+	DOFLUSH;
+	if (out_owned) {
+		free(out);
+		out = NULL;
+		out_cap = 0;
+	}
+	close_resize_pipe();
+	disableRawMode();
+}
+
 void wdsc_set(int x, int y, char c) {
-	/* Save cursor position */
-	ESC;
-	QPUTC('7');
+	if (buffered) {
+		if (x < 1 || y < 1 || x > grid_w || y > grid_h)
+			return;
+		struct wdsc_cell *cell = &back[(y - 1) * grid_w + x - 1];
+		cell->c = c ? c : ' ';
+		cell->pen = pen;
+		return;
+	}
 
 	/* Jump to X, Y */
-	csi_cup(x, y);
+	move_to(x, y);
 
 	/* Draw character */
+	sgr_to(&pen);
 	QPUTC(c);
-
-	/* Restore cursor position */
-	ESC;
-	QPUTC('8');
+	moved_over(x, 1, plain_char(c));
 }
 
 void wdsc_puts(int x, int y, const char *s) {
-	/* Save cursor position */
-	ESC;
-	QPUTC('7');
+	if (buffered) {
+		for (; *s && x <= grid_w; s++, x++)
+			wdsc_set(x, y, *s);
+		return;
+	}
 
 	/* Jump to X, Y */
-	csi_cup(x, y);
+	move_to(x, y);
 
 	/* Print the string. */
-	fprintf(stdout, "%s", s);
-
-	/* Restore cursor position */
-	ESC;
-	QPUTC('8');
+	int n = 0;
+	bool plain = true;
+	for (; s[n]; n++)
+		plain = plain && plain_char(s[n]);
+	sgr_to(&pen);
+	out_puts(s);
+	moved_over(x, n, plain);
 }
 
 void wdsc_set_cursor(int x, int y) {
-	csi_cup(x, y);
+	want_x = x;
+	want_y = y;
 }
 
 void wdsc_attr_on(int n) {
-	CSI;
-	fprintf(stdout, "%i", n);
-	SGR_TAIL;
+	pen_apply(&n, 1);
 }
 
 void wdsc_attr_on_s(char * s) {
-	CSI;
-	fprintf(stdout, "%s", s);
-	SGR_TAIL;
+	/* Split it up at the semicolons, and each parameter at the colons */
+	int p[WDSC_SGR_MAX];
+	int n = 0;
+	for (;;) {
+		int sub[6] = {0, 0, 0, 0, 0, 0};
+		int k = 0;
+		for (; *s && *s != ';'; s++) {
+			if (*s == ':')
+				k++;
+			else if (*s >= '0' && *s <= '9' && k < 6 &&
+				 sub[k] < 10000)
+				sub[k] = sub[k] * 10 + *s - '0';
+		}
+		n = sgr_sub(p, n, sub, k + 1);
+		if (*s != ';')
+			break;
+		s++;
+	}
+	pen_apply(p, n);
 }
 
 void wdsc_attr_off() {
-	CSI;
-	QPUTC('0');
-	SGR_TAIL;
+	pen = default_pen;
+}
+
+void wdsc_fg(int color) {
+	pen.fg = color;
+}
+
+void wdsc_bg(int color) {
+	pen.bg = color;
 }
 
 void wdsc_clear() {
+	if (buffered) {
+		blank_cells(back, grid_w * grid_h);
+		return;
+	}
+
+	/* This fills the screen with the background color */
+	sgr_to(&pen);
 	CSI;
 	QPUTC('2');
 	QPUTC('J');
 }
 
-void wdsc_screensize(int *x, int *y) {
-	/* Save cursor position */
+/* Now, in milliseconds, by a clock that doesn't jump around */
+static long long now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* The timer due soonest, or -1 if there are none */
+static int next_timer() {
+	int next = -1;
+	for (int i = 0; i < WDSC_MAX_TIMERS; i++)
+		if (timers[i].due &&
+		    (next < 0 || timers[i].due < timers[next].due))
+			next = i;
+	return next;
+}
+
+/* Make a WDSC_EV_TIMER event for timer t, and set it up for next time.
+ * A repeating timer that's fallen behind skips the times it missed,
+ * rather than firing again and again to catch up. */
+static void fire_timer(struct wdsc_event *ev, int t, long long now) {
+	memset(ev, 0, sizeof(*ev));
+	ev->type = WDSC_EV_TIMER;
+	ev->id = t;
+	if (!timers[t].interval) {
+		timers[t].due = 0;
+		return;
+	}
+	timers[t].due += timers[t].interval;
+	if (timers[t].due <= now)
+		timers[t].due = now + timers[t].interval;
+}
+
+/*
+ * Wait up to ms milliseconds (forever if ms is negative) for input, and
+ * read all there is, or as much as fits, into the input buffer. Returns 1
+ * if we got some, 0 if not, or WDSC_RESIZE if the terminal was resized
+ * (only if resize is true; otherwise that waits in the pipe). Call
+ * resized() after that.
+ *
+ * ev is nullable; if it isn't, we watch the other fds and the timers too,
+ * and if one of them goes off first, fill in ev and return its type.
+ */
+static int in_read(int ms, bool resize, struct wdsc_event *ev) {
+	/* Move what's left to the front, to make room */
+	if (in_pos > 0) {
+		memmove(in_buf, in_buf + in_pos, in_len - in_pos);
+		in_len -= in_pos;
+		in_pos = 0;
+	}
+	if (in_len == WDSC_IN_MAX)
+		return 1;
+
+	struct pollfd pfd[2 + WDSC_MAX_FDS] = {
+		{in_eof ? -1 : STDIN_FILENO, POLLIN, 0},
+		{resize ? resize_pipe[0] : -1, POLLIN, 0},
+	};
+	int nfds = 2;
+	if (ev) {
+		for (int i = 0; i < nwatched; i++)
+			pfd[nfds++] = watched[(watch_turn + i) % nwatched];
+	}
+
+	long long deadline = ms < 0 ? -1 : now_ms() + ms;
+	for (;;) {
+		long long now = now_ms();
+		long long wait = deadline < 0 ? -1 : deadline - now;
+		if (deadline >= 0 && wait < 0)
+			wait = 0;
+
+		/* Don't sleep through a timer */
+		int t = ev ? next_timer() : -1;
+		if (t >= 0) {
+			if (timers[t].due <= now) {
+				fire_timer(ev, t, now);
+				return WDSC_EV_TIMER;
+			}
+			if (wait < 0 || timers[t].due - now < wait)
+				wait = timers[t].due - now;
+		}
+
+		int r = poll(pfd, nfds, (int)wait);
+		if (r < 0 && errno != EINTR)
+			die("poll");
+		if (r <= 0) {
+			if (r == 0 && deadline >= 0 && now_ms() >= deadline)
+				return 0;
+			continue;
+		}
+
+		if (pfd[1].revents & POLLIN) {
+			char junk[64];
+			while (read(resize_pipe[0], junk, sizeof(junk)) > 0);
+			return WDSC_RESIZE;
+		}
+
+		if (pfd[0].revents) {
+			ssize_t n = read(STDIN_FILENO, in_buf + in_len,
+					 WDSC_IN_MAX - in_len);
+			if (n > 0) {
+				in_len += n;
+				return 1;
+			}
+			if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+				in_eof = true;
+				pfd[0].fd = -1;
+			}
+		}
+
+		for (int i = 2; i < nfds; i++) {
+			if (!pfd[i].revents)
+				continue;
+			memset(ev, 0, sizeof(*ev));
+			ev->type = WDSC_EV_FD;
+			ev->id = pfd[i].fd;
+			ev->revents = pfd[i].revents;
+			watch_turn = (watch_turn + i - 1) % nwatched;
+			return WDSC_EV_FD;
+		}
+	}
+}
+
+/* If the input buffer holds a cursor position report, ESC [ y ; x R, take
+ * it out and return true */
+static bool take_cpr(int *x, int *y) {
+	for (int i = in_pos; i + 1 < in_len; i++) {
+		if (in_buf[i] != 033 || in_buf[i + 1] != '[')
+			continue;
+		int num[2] = {0, 0};
+		int idx = 0;
+		int j = i + 2;
+		for (; j < in_len; j++) {
+			unsigned char c = in_buf[j];
+			if (c == ';' && idx == 0) {
+				idx = 1;
+			} else if (c >= '0' && c <= '9' && num[idx] < 10000) {
+				num[idx] = num[idx] * 10 + c - '0';
+			} else if (c < '0' || c > '9') {
+				break;
+			}
+		}
+		if (j == in_len || in_buf[j] != 'R' || idx != 1)
+			continue;
+		memmove(in_buf + i, in_buf + j + 1, in_len - j - 1);
+		in_len -= j + 1 - i;
+		*x = num[1];
+		*y = num[0];
+		return true;
+	}
+	return false;
+}
+
+/* Ask the terminal where the cursor ends up if we send it very very far to
+ * the bottom right; false if it doesn't say */
+static bool probe_size(int *w, int *h) {
+	/* We only get one saved cursor position, so give it back first */
+	if (saved)
+		restore_cursor();
+
+	/* Save the cursor, jump, request the cursor position, and restore;
+	 * the terminal answers with where it was when we asked */
 	ESC;
 	QPUTC('7');
-
-	/* Jump very very far to the bottom right */
 	csi_cup(999, 999);
-
-	/* Request the cursor position */
 	CSI;
 	QPUTC('6');
 	QPUTC('n');
+	ESC;
+	QPUTC('8');
 
 	/* Flush, so we don't get caught here */
 	DOFLUSH;
 
-	/* Snarf the terminal's response */
-	char ecks[5];
-	char why[5];
-	for (int i = 0; i < 5; i++) {
-		ecks[i] = 0;
-		why[i] = 0;
-	}
-	int idx = 0;
-	bool snarfingX = false;
-	for(;;) {
-		char c = wdsc_poll();
-		if (c == 033 || c == '[') {
-			/* do nothing */
-		} else if (c == ';') {
-			snarfingX = true;
-			idx = 0;
-		} else if (c == 'R') {
+	/* Wait for the answer, keeping any other input for later */
+	for (;;) {
+		if (take_cpr(w, h))
+			return *w > 0 && *h > 0;
+		if (in_len - in_pos == WDSC_IN_MAX ||
+		    in_read(WDSC_DSR_TIMEOUT, false, NULL) != 1)
+			return false;
+	}
+}
+
+/* Find out how big the terminal is, the quick way if we can */
+static void update_size() {
+	struct winsize ws;
+	int w = 0;
+	int h = 0;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 &&
+	    ws.ws_row > 0) {
+		w = ws.ws_col;
+		h = ws.ws_row;
+	} else if (!probe_size(&w, &h)) {
+		if (scr_w)
+			return;
+		w = 80;
+		h = 24;
+	}
+	scr_w = w;
+	scr_h = h;
+
+	/* Keep the grid the same size as the terminal */
+	if (buffered && (w != grid_w || h != grid_h))
+		resize_grid(w, h);
+}
+
+void wdsc_screensize(int *x, int *y) {
+	if (!scr_w)
+		update_size();
+	*x = scr_w;
+	*y = scr_h;
+}
+
+/* Catch up with the terminal being resized */
+static void resized() {
+	update_size();
+	wdsc_redraw();
+	cur_x = 0;
+	cur_y = 0;
+}
+
+int wdsc_poll() {
+	return wdsc_poll_timeout(-1);
+}
+
+int wdsc_poll_timeout(int ms) {
+	if (in_pos == in_len) {
+		int r = in_read(ms, true, NULL);
+		if (r == WDSC_RESIZE) {
+			resized();
+			return WDSC_RESIZE;
+		}
+		if (r == 0)
+			return WDSC_TIMEOUT;
+	}
+	return in_buf[in_pos++];
+}
+
+/* Keys for CSI c, CSI 1 ; mod c and SS3 c, by the final byte c - 'A' */
+static const int final_keys[26] = {
+	WDSC_KEY_UP, WDSC_KEY_DOWN, WDSC_KEY_RIGHT, WDSC_KEY_LEFT, 0,
+	WDSC_KEY_END, 0, WDSC_KEY_HOME, 0, 0, 0, 0, 0, 0, 0,
+	WDSC_KEY_F1, WDSC_KEY_F2, WDSC_KEY_F3, WDSC_KEY_F4, 0, 0, 0, 0, 0, 0,
+	WDSC_KEY_BACKTAB,
+};
+
+/* Keys for CSI n ~ and CSI n ; mod ~, by n */
+static const int tilde_keys[25] = {
+	0, WDSC_KEY_HOME, WDSC_KEY_INSERT, WDSC_KEY_DELETE, WDSC_KEY_END,
+	WDSC_KEY_PGUP, WDSC_KEY_PGDN, WDSC_KEY_HOME, WDSC_KEY_END, 0, 0,
+	WDSC_KEY_F1, WDSC_KEY_F2, WDSC_KEY_F3, WDSC_KEY_F4, WDSC_KEY_F5, 0,
+	WDSC_KEY_F6, WDSC_KEY_F7, WDSC_KEY_F8, WDSC_KEY_F9, WDSC_KEY_F10, 0,
+	WDSC_KEY_F11, WDSC_KEY_F12,
+};
+
+/* Longest escape sequence we'll wait for the end of */
+#define SEQ_MAX 64
+
+/* Decode the UTF-8 character at in_buf[i] into *key; returns its length, or
+ * 0 if it isn't all here yet. Bytes that aren't UTF-8 come out as
+ * themselves. */
+static int decode_char(int i, int *key, bool final) {
+	unsigned char c = in_buf[i];
+	int len = 1;
+	if (c >= 0xc0 && c < 0xe0)
+		len = 2;
+	else if (c >= 0xe0 && c < 0xf0)
+		len = 3;
+	else if (c >= 0xf0 && c < 0xf8)
+		len = 4;
+	int k = c & (0xff >> (len + 1));
+	for (int j = 1; j < len; j++) {
+		if (i + j == in_len) {
+			if (!final)
+				return 0;
+			len = 1;
+			break;
+		}
+		if ((in_buf[i + j] & 0xc0) != 0x80) {
+			len = 1;
 			break;
-		} else if (snarfingX) {
-			ecks[idx++] = c;
-		} else {
-			why[idx++] = c;
 		}
+		k = k << 6 | (in_buf[i + j] & 0x3f);
 	}
+	*key = len == 1 ? c : k;
+	return len;
+}
+
+/* Fill in a mouse event from xterm's button byte b (less 32) */
+static void mouse_event(struct wdsc_event *ev, int b, int x, int y) {
+	ev->type = WDSC_EV_MOUSE;
+	ev->key = b & 32 ? WDSC_MOUSE_MOVE : WDSC_MOUSE_PRESS;
+	ev->button = (b & 3) + (b & 64 ? 4 : 0) + (b & 128 ? 8 : 0);
+	ev->mod = (b & 4 ? WDSC_MOD_SHIFT : 0) | (b & 8 ? WDSC_MOD_ALT : 0) |
+		(b & 16 ? WDSC_MOD_CTRL : 0);
+	ev->x = x;
+	ev->y = y;
+}
 
-	/* Update the variables */
-	*x = atoi(ecks);
-	*y = atoi(why);
+/*
+ * Decode an event from the input buffer. Returns 1 if it did, 2 if it only
+ * used up something that isn't an event (like the start of a paste), or 0
+ * if what's there is the start of something longer; unless final is true,
+ * meaning no more is coming soon, in which case we make the best of it.
+ */
+static int decode(struct wdsc_event *ev, bool final) {
+	unsigned char *s = in_buf + in_pos;
+	int n = in_len - in_pos;
+	ev->type = WDSC_EV_KEY;
+	ev->mod = pasting ? WDSC_MOD_PASTE : 0;
+	ev->button = 0;
+	ev->x = 0;
+	ev->y = 0;
+	ev->id = 0;
+	ev->revents = 0;
 
-	/* Restore cursor position */
-	ESC;
-	QPUTC('8');
+	if (s[0] != 033 || n == 1) {
+		if (s[0] == 033 && !final)
+			return 0;
+		int len = decode_char(in_pos, &ev->key, final);
+		in_pos += len;
+		return len ? 1 : 0;
+	}
+
+	/* In a paste, everything's a key, until the end of it */
+	if (pasting) {
+		static const char end[] = "\033[201~";
+		int i = 1;
+		while (i < n && i < 6 && s[i] == end[i])
+			i++;
+		if (i == 6) {
+			pasting = false;
+			in_pos += 6;
+			return 2;
+		}
+		if (i == n && !final)
+			return 0;
+		ev->key = 033;
+		in_pos++;
+		return 1;
+	}
+
+	/* ESC O c */
+	if (s[1] == 'O' && n == 2 && !final)
+		return 0;
+	if (s[1] == 'O' && n > 2 && s[2] >= 'A' && s[2] <= 'Z' &&
+	    final_keys[s[2] - 'A']) {
+		ev->key = final_keys[s[2] - 'A'];
+		in_pos += 3;
+		return 1;
+	}
+
+	/* Anything but ESC [ is Alt and a character, or a lone Escape */
+	if (s[1] != '[') {
+		if (s[1] == 033) {
+			ev->key = 033;
+			in_pos++;
+			return 1;
+		}
+		int len = decode_char(in_pos + 1, &ev->key, final);
+		if (!len)
+			return 0;
+		ev->mod |= WDSC_MOD_ALT;
+		in_pos += 1 + len;
+		return 1;
+	}
+
+	/* ESC [, then parameters, intermediates, and a final byte */
+	int p[8] = {0};
+	int np = 0;
+	int i = 2;
+	char prefix = 0;
+	if (i < n && s[i] >= '<' && s[i] <= '?')
+		prefix = s[i++];
+	int start = i;
+	for (; i < n && s[i] >= '0' && s[i] <= ';'; i++) {
+		if (s[i] == ';' || s[i] == ':') {
+			if (np < 7)
+				np++;
+		} else if (p[np] < 10000) {
+			p[np] = p[np] * 10 + s[i] - '0';
+		}
+	}
+	if (i > start)
+		np++;
+	while (i < n && s[i] >= ' ' && s[i] <= '/')
+		i++;
+	if (i == n && n < SEQ_MAX && !final)
+		return 0;
+	if (i == n || s[i] < '@' || s[i] > '~') {
+		/* Not a sequence after all */
+		ev->key = 033;
+		in_pos++;
+		return 1;
+	}
+	char c = s[i++];
+
+	/* X10 mouse: ESC [ M b x y, each plus 32 */
+	if (c == 'M' && i == 3) {
+		if (n < 6) {
+			if (!final)
+				return 0;
+			ev->key = 033;
+			in_pos++;
+			return 1;
+		}
+		int b = s[3] - 32;
+		mouse_event(ev, b, s[4] - 32, s[5] - 32);
+		if ((b & 3) == 3 && !(b & 96)) {
+			ev->key = WDSC_MOUSE_RELEASE;
+			ev->button = WDSC_MOUSE_NONE;
+		}
+		in_pos += 6;
+		return 1;
+	}
+	in_pos += i;
+
+	/* SGR mouse: ESC [ < b ; x ; y M (or m for release) */
+	if (prefix == '<' && (c == 'M' || c == 'm') && np == 3) {
+		mouse_event(ev, p[0], p[1], p[2]);
+		if (c == 'm')
+			ev->key = WDSC_MOUSE_RELEASE;
+		return 1;
+	}
+	if (prefix)
+		return 2;
+
+	if (np > 1 && p[1] > 1)
+		ev->mod |= (p[1] - 1) & 15;
+	if (c == '~') {
+		if (p[0] == 200) {
+			pasting = true;
+			return 2;
+		}
+		if (p[0] < 25 && tilde_keys[p[0]]) {
+			ev->key = tilde_keys[p[0]];
+			return 1;
+		}
+	} else if (c >= 'A' && c <= 'Z' && final_keys[c - 'A']) {
+		ev->key = final_keys[c - 'A'];
+		return 1;
+	}
+	return 2;
 }
 
-char wdsc_poll() {
-	char c;
-	while (read(STDIN_FILENO, &c, 1) != 1);
-	return c;
+int wdsc_poll_event(struct wdsc_event *ev) {
+	return wdsc_poll_event_timeout(ev, -1);
 }
 
+int wdsc_poll_event_timeout(struct wdsc_event *ev, int ms) {
+	long long deadline = ms < 0 ? -1 : now_ms() + ms;
+	bool final = false;
+	for (;;) {
+		if (in_pos < in_len) {
+			int r = decode(ev, final);
+			if (r == 1)
+				return ev->type;
+			if (r == 2)
+				continue;
+		}
+
+		/* Wait for more; if we have the start of a sequence, only as
+		 * long as the rest of it should take */
+		int wait = -1;
+		if (in_pos < in_len) {
+			wait = esc_timeout;
+		} else if (deadline >= 0) {
+			long long left = deadline - now_ms();
+			wait = left > 0 ? (int)left : 0;
+		}
+		int r = in_read(wait, true, ev);
+		if (r == WDSC_EV_FD || r == WDSC_EV_TIMER)
+			return r;
+		if (r == WDSC_RESIZE) {
+			resized();
+			memset(ev, 0, sizeof(*ev));
+			ev->type = WDSC_EV_RESIZE;
+			return ev->type;
+		}
+		if (r == 0 && in_pos == in_len) {
+			memset(ev, 0, sizeof(*ev));
+			ev->type = WDSC_EV_TIMEOUT;
+			return ev->type;
+		}
+		final = r == 0;
+	}
+}
+
+int wdsc_fd() {
+	return STDIN_FILENO;
+}
+
+int wdsc_resize_fd() {
+	return resize_pipe[0];
+}
+
+int wdsc_watch_fd(int fd, int events) {
+	for (int i = 0; i < nwatched; i++) {
+		if (watched[i].fd == fd) {
+			watched[i].events = events;
+			return 0;
+		}
+	}
+	if (nwatched == WDSC_MAX_FDS)
+		return -1;
+	watched[nwatched].fd = fd;
+	watched[nwatched].events = events;
+	watched[nwatched].revents = 0;
+	nwatched++;
+	return 0;
+}
+
+void wdsc_unwatch_fd(int fd) {
+	for (int i = 0; i < nwatched; i++) {
+		if (watched[i].fd == fd) {
+			watched[i] = watched[--nwatched];
+			watch_turn = 0;
+			return;
+		}
+	}
+}
+
+int wdsc_add_timer(int ms, int repeat) {
+	for (int i = 0; i < WDSC_MAX_TIMERS; i++) {
+		if (timers[i].due)
+			continue;
+		if (ms < 1)
+			ms = 1;
+		timers[i].due = now_ms() + ms;
+		timers[i].interval = repeat ? ms : 0;
+		return i;
+	}
+	return -1;
+}
+
+void wdsc_remove_timer(int id) {
+	if (id >= 0 && id < WDSC_MAX_TIMERS)
+		timers[id].due = 0;
+}
+
+void wdsc_esc_timeout(int ms) {
+	esc_timeout = ms;
+}
+
+void wdsc_mouse_on() {
+	mouse = true;
+	CSI;
+	out_puts("?1000;1002;1006h");
+}
+
+void wdsc_mouse_off() {
+	mouse = false;
+	CSI;
+	out_puts("?1000;1002;1006l");
+}
+
+void wdsc_paste_on() {
+	paste = true;
+	CSI;
+	out_puts("?2004h");
+}
+
+void wdsc_paste_off() {
+	paste = false;
+	CSI;
+	out_puts("?2004l");
+}
 
 void wdsc_hide_cursor() {
 	CSI;